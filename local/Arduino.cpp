@@ -1,35 +1,102 @@
 #include "Arduino.h"
 
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <string>
-#include <thread>
 
+#include <poll.h>
+#include <unistd.h>
+
+#include "Bench.h"
+#include "Devices.h"
+#include "Plant.h"
 #include "Preferences.h"
+#include "Tasks.h"
 
 using std::ifstream;
 using std::ofstream;
 using std::printf;
 using std::string;
 using std::terminate;
-using std::chrono::duration_cast;
-using std::chrono::microseconds;
-using std::chrono::milliseconds;
-using std::this_thread::sleep_for;
+using std::chrono::duration;
 using clk = std::chrono::steady_clock;
 
 void HardwareSerial::begin(int) {
 	initialized = true;
 }
 
+int HardwareSerial::available() {
+	auto fds = pollfd{STDIN_FILENO, POLLIN, 0};
+	if (input.empty() && poll(&fds, 1, 0) > 0 && (fds.revents & POLLIN)) {
+		char buf[64];
+		auto const n = ::read(STDIN_FILENO, buf, sizeof(buf));
+		input.insert(input.end(), buf, buf + std::max(n, ssize_t{0}));
+	}
+	return static_cast<int>(input.size());
+}
+
+int HardwareSerial::read() {
+	if (available() == 0) {
+		return -1;
+	}
+	auto const c = input.front();
+	input.pop_front();
+	return static_cast<unsigned char>(c);
+}
+
+int HardwareSerial::peek() {
+	return available() > 0 ? static_cast<unsigned char>(input.front()) : -1;
+}
+
+// Virtual clock. Time only moves when the firmware waits or a loop() pass
+// ends with every task blocked, so a roast runs as fast as the CPU allows
+// and every run sees the same timeline. Starts at 1s, a zero Timestamp means "never" to the
+// firmware.
+static auto simMicros = uint64_t{1000000};
+
+// For the bench, micros() also counts the host time a thread has been
+// running since it woke up. The profiler and the tick monitor then see how
+// long the firmware's code really takes, while millis() and the task wake
+// ups stay on the virtual clock.
+static auto wallMicros = false;
+static thread_local auto wallFrom = clk::time_point{};
+
+namespace sim {
+
+auto clockMicros() -> uint64_t {
+	return simMicros;
+}
+
+auto clockResume() -> void {
+	wallFrom = clk::now();
+}
+
+}  // namespace sim
+
+void delay(unsigned long ms) {
+	simMicros += ms * 1000;
+}
+
 void delayMicroseconds(unsigned long us) {
-	sleep_for(microseconds{us});
+	simMicros += us;
 }
 
 auto millis() -> unsigned long {
-	return duration_cast<milliseconds>(clk::now().time_since_epoch()).count();
+	return static_cast<unsigned long>(simMicros / 1000);
+}
+
+auto micros() -> unsigned long {
+	auto us = simMicros;
+	if (wallMicros) {
+		us += static_cast<uint64_t>(
+			duration<double, std::micro>(clk::now() - wallFrom).count());
+	}
+	return static_cast<unsigned long>(us);
 }
 
 auto pinModes = std::array<uint8_t, 256>{};
@@ -55,10 +122,78 @@ auto digitalRead(uint8_t pin) -> uint8_t {
 void setup();
 void loop();
 
+static auto envOr(char const* name, unsigned long fallback)
+	-> unsigned long {
+	auto const value = std::getenv(name);
+	return value ? std::strtoul(value, nullptr, 10) : fallback;
+}
+
+static std::atomic<bool> stopRequested{false};
+
+static auto report(uint64_t startMicros, clk::time_point wallStart) -> void {
+	auto const simSeconds = (simMicros - startMicros) / 1e6;
+	auto const wallSeconds =
+		duration<double>(clk::now() - wallStart).count();
+	std::fprintf(stderr,
+				 "sim: %.0f simulated s in %.2f wall s, %.0f sim s/wall s\n",
+				 simSeconds, wallSeconds,
+				 wallSeconds > 0 ? simSeconds / wallSeconds : 0.0);
+}
+
+// SIM_SECONDS: simulated time to run for, 0 runs until interrupted
+// SIM_LOOP_US: simulated time one loop() pass takes
+// SIM_BENCH: runs the benchmarks, then profiles the firmware on host time
+// for SIM_SECONDS if that is set
 auto main() -> int {
+	auto const runFor = uint64_t{envOr("SIM_SECONDS", 0)} * 1000000;
+	auto const loopStep = envOr("SIM_LOOP_US", 1000);
+	auto const bench = std::getenv("SIM_BENCH") != nullptr;
+	if (bench) {
+		sim::runBenchmarks();
+		if (runFor == 0) {
+			return 0;
+		}
+		wallMicros = true;
+	}
+	std::signal(SIGINT, [](int) { stopRequested = true; });
+
+	auto const startMicros = simMicros;
+	auto const wallStart = clk::now();
+	auto lastReport = wallStart;
+
+	sim::clockResume();
+	sim::devicesBegin();
 	setup();
-	while (true) {
-		loop();
+	while (!stopRequested &&
+		   (runFor == 0 || simMicros - startMicros < runFor)) {
+		sim::clockResume();
+		if (!sim::loopDeleted()) {
+			loop();
+		}
+		sim::tasksSettle();
+		simMicros += loopStep;
+		sim::clockResume();
+		sim::plant().step(loopStep);
+		sim::devicesStep();
+		sim::tasksRelease(simMicros);
+
+		if (clk::now() - lastReport > std::chrono::seconds{10}) {
+			lastReport = clk::now();
+			report(startMicros, wallStart);
+			sim::plant().report();
+		}
+	}
+	sim::tasksStop();
+	report(startMicros, wallStart);
+	sim::plant().report();
+	sim::devicesReport();
+	if (bench) {
+		sim::benchReport();
+	}
+
+	if (auto const failed = sim::scriptFailures()) {
+		std::fprintf(stderr, "sim: %u script expectations failed\n", failed);
+		return 1;
 	}
 }
 
@@ -1,6 +1,10 @@
 #pragma once
 #include <HardwareSerial.h>
+#include <WString.h>
 #include <cstdint>
+#include <cstdio>
+
+using std::printf;
 
 constexpr auto INPUT = 0;
 constexpr auto INPUT_PULLUP = 1;
@@ -9,8 +13,12 @@ constexpr auto OUTPUT = 2;
 constexpr auto LOW = 0;
 constexpr auto HIGH = 1;
 
+constexpr auto SERIAL_8N1 = 0x800001c;
+
+void delay(unsigned long ms);
 void delayMicroseconds(unsigned long us);
 auto millis() -> unsigned long;
+auto micros() -> unsigned long;
 
 void pinMode(uint8_t pin, uint8_t mode);
 void digitalWrite(uint8_t pin, uint8_t value);
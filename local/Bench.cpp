@@ -0,0 +1,170 @@
+#include "Bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <random>
+
+#include "RtuLink.h"
+#include "kev/ModbusRtu.h"
+#include "kev/Profiler.h"
+#include "kev/TempFilter.h"
+#include "kev/TempSampler.h"
+#include "kev/TempSensor.h"
+#include "kev/TickMonitor.h"
+
+// src/main.cpp
+extern kev::TickMonitor controlTick;
+
+namespace sim {
+
+using clk = std::chrono::steady_clock;
+
+// Keeps the optimizer from dropping the work being timed
+static volatile unsigned long sink;
+
+template <class F>
+static auto bench(char const* name, F&& f) -> void {
+	constexpr auto ROUNDS = 200000;
+	for (auto i = 0; i < ROUNDS / 10; ++i) {
+		sink = sink + f();
+	}
+	auto const start = clk::now();
+	for (auto i = 0; i < ROUNDS; ++i) {
+		sink = sink + f();
+	}
+	auto const ns =
+		std::chrono::duration<double, std::nano>(clk::now() - start).count();
+	std::fprintf(stderr, "bench: %-28s %8.1f ns\n", name, ns / ROUNDS);
+}
+
+// A chamber on the hysteresis control in Main.h, read through `Filter` the
+// way TempSensorMax6675 does: a zero read is dropped and the last value held.
+// A noisy MAX6675 adds 0.75 °C gaussian noise with 1% zero reads and 1%
+// +40 °C spikes, on the same seed for every filter. Returns how often the fan
+// relay switched.
+template <class Filter>
+static auto fanToggles(bool noisy) -> unsigned long {
+	using namespace kev::literals;
+	constexpr auto FAN_ON_BELOW = 58.0;
+	constexpr auto FAN_OFF_ABOVE = 60.0;
+	constexpr auto SAMPLES = 2 * 3600 * 2;  // 2 h at TEMP_SAMPLE_PERIOD
+	// °C a sample, heated air with the fan on and losses with it off
+	constexpr auto RISE = 0.02;
+
+	auto rng = std::mt19937{42};
+	auto gauss = std::normal_distribution<double>{0.0, 0.75};
+	auto percent = std::uniform_int_distribution<int>{0, 99};
+
+	auto filter = Filter{};
+	auto temp = 50.0;
+	auto fan = false;
+	auto shown = std::optional<double>{};
+	auto toggles = 0ul;
+	auto now = kev::Timestamp{1};
+	for (auto i = 0; i < SAMPLES; ++i) {
+		temp += fan ? RISE : -RISE;
+		now = now + kev::TEMP_SAMPLE_PERIOD;
+
+		// Quarter degrees, like the chip
+		auto read = std::round((temp + (noisy ? gauss(rng) : 0.0)) * 4) / 4;
+		auto const glitch = noisy ? percent(rng) : -1;
+		if (glitch == 0) {
+			continue;  // Read as zero
+		}
+		if (glitch == 1) {
+			read += 40;
+		}
+		if (auto const out = filter.apply(read, now)) {
+			shown = out;
+		}
+
+		if (!shown) {
+			continue;
+		}
+		if (fan && *shown > FAN_OFF_ABOVE) {
+			fan = false;
+			++toggles;
+		} else if (!fan && *shown < FAN_ON_BELOW) {
+			fan = true;
+			++toggles;
+		}
+	}
+	return toggles;
+}
+
+template <class Filter>
+static auto benchFilter(char const* name) -> void {
+	std::fprintf(stderr, "bench: %-28s %8lu fan toggles in 2 h\n", name,
+				 fanToggles<Filter>(true));
+}
+
+auto runBenchmarks() -> void {
+	auto frame = std::array<uint8_t, kev::MODBUS_MAX_FRAME>{};
+	for (auto i = size_t{0}; i < frame.size(); ++i) {
+		frame[i] = static_cast<uint8_t>(i * 37);
+	}
+
+	// The bitwise CRC the firmware used before, same as the simulated slaves
+	bench("crc 256 bytes, bitwise", [&] {
+		return rtuCrc(frame.data(), frame.size());
+	});
+	bench("crc 256 bytes, table", [&] {
+		return kev::modbusCrc(frame.data(), frame.size());
+	});
+
+	// The largest frames the panel sees: the status strings and the lamps
+	auto write = kev::ModbusRequest{};
+	write.slave = 1;
+	write.function = kev::ModbusFunction::WriteMultipleRegisters;
+	write.address = 100;
+	write.count = 60;
+	bench("encode write 60 registers", [&] {
+		return kev::modbusEncode(write, frame.data());
+	});
+
+	auto read = kev::ModbusRequest{};
+	read.slave = 1;
+	read.function = kev::ModbusFunction::ReadCoils;
+	read.address = 20;
+	read.count = 8;
+	auto answer = std::array<uint8_t, 6>{1, 0x01, 1, 0x5A};
+	auto const crc = kev::modbusCrc(answer.data(), 4);
+	answer[4] = static_cast<uint8_t>(crc & 0xFF);
+	answer[5] = static_cast<uint8_t>(crc >> 8);
+	bench("decode read 8 coils", [&] {
+		return static_cast<unsigned long>(
+			kev::modbusDecode(read, answer.data(), answer.size()));
+	});
+
+	// What each TempFilter stage buys against relay chatter, next to the
+	// count a clean sensor gives
+	std::fprintf(stderr, "bench: %-28s %8lu fan toggles in 2 h\n",
+				 "clean sensor", fanToggles<kev::TempFilter<>>(false));
+	benchFilter<kev::TempFilter<>>("raw readings");
+	benchFilter<kev::TempFilter<kev::RateStage<5>>>("rate only");
+	benchFilter<kev::TempFilter<kev::MedianStage<3>>>("median of 3 only");
+	benchFilter<kev::TempFilter<kev::EmaStage<50>>>("ema 50% only");
+	benchFilter<kev::Max6675Filter>("rate, median 3, ema 50%");
+}
+
+static auto showHistogram(char const* name, kev::HistogramSummary h)
+	-> void {
+	std::fprintf(stderr, "bench: %-14s %8lu %8ld %8ld %8ld %8ld %8ld\n", name,
+				 h.count, h.min, h.mean, h.p50, h.p99, h.max);
+}
+
+auto benchReport() -> void {
+	std::fprintf(stderr, "bench: %-14s %8s %8s %8s %8s %8s %8s\n",
+				 "tick (us)", "count", "min", "mean", "p50", "p99", "max");
+	kev::profRegistry.forEach([](kev::ProfSite const& site) {
+		showHistogram(site.name, site.hist.summary());
+	});
+	showHistogram("control late", controlTick.latenessStats());
+	showHistogram("control work", controlTick.workStats());
+	std::fprintf(stderr, "bench: control %lu ticks - %lu overruns\n",
+				 controlTick.tickCount(), controlTick.overrunCount());
+}
+
+}  // namespace sim
@@ -0,0 +1,12 @@
+#pragma once
+
+namespace sim {
+
+// Host timings of the firmware's hot pure code and the fan relay chatter
+// left through the temperature filter, run with SIM_BENCH set
+auto runBenchmarks() -> void;
+// Where the firmware spent its ticks in a bench run, from the profiler and
+// the control tick monitor
+auto benchReport() -> void;
+
+}  // namespace sim
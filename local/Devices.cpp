@@ -0,0 +1,351 @@
+#include "Devices.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "Arduino.h"
+#include "Plant.h"
+#include "Ui.h"
+#include "kev/AutonicsTempController.h"
+
+namespace sim {
+
+// Reading the screen and the controller doesn't take long, writes to the
+// panel's flash backed registers do a bit longer. Close enough to what the
+// scope showed on the real bus.
+constexpr auto AUTONICS_TURNAROUND_MICROS = 3000ul;
+constexpr auto HMI_TURNAROUND_MICROS = 8000ul;
+
+AutonicsModel::AutonicsModel()
+	: RegisterSlave{AUTONICS_ADDRESS, 0, kev::AUTONICS_OUT1_ADDRESS + 1,
+					kev::AUTONICS_RUN_ADDRESS + 1,
+					kev::AUTONICS_PV_ADDRESS + 1} {
+	timing.turnaroundMicros = AUTONICS_TURNAROUND_MICROS;
+	holdingRegs[kev::AUTONICS_RUN_ADDRESS] = 1;  // Stopped
+}
+
+auto AutonicsModel::beforeRead() -> void {
+	auto& p = plant();
+	inputRegs[kev::AUTONICS_PV_ADDRESS] =
+		static_cast<uint16_t>(std::lround(p.heaterTemp()));
+	discreteInputs[kev::AUTONICS_OUT1_ADDRESS] = p.heaterOut();
+}
+
+auto AutonicsModel::afterWriteRegs(uint16_t, uint16_t) -> void {
+	plant().setHeater(holdingRegs[kev::AUTONICS_RUN_ADDRESS] == 0,
+					  holdingRegs[kev::AUTONICS_SV_ADDRESS]);
+}
+
+KincoModel::KincoModel()
+	: RegisterSlave{HMI_ADDRESS,
+					UI_MAP.flagCoils ? UI_BUTTONS.end() : 0u,
+					0,
+					std::max(UI_STRINGS.end(), UI_CONFIG.end()),
+					0} {
+	timing.turnaroundMicros = HMI_TURNAROUND_MICROS;
+}
+
+static auto buttonOffset(std::string const& name) -> int {
+#define BUTTON(field)                                       \
+	if (name == #field) {                                   \
+		return static_cast<int>(offsetof(Buttons, field)); \
+	}
+	BUTTON(rotate_fw)
+	BUTTON(rotate_bw)
+	BUTTON(pause)
+	BUTTON(start)
+	BUTTON(preheat)
+	BUTTON(stop)
+	BUTTON(config)
+	BUTTON(config_back)
+#undef BUTTON
+	return -1;
+}
+
+static auto configOffset(std::string const& field) -> int {
+	if (field == "preheatTemp") {
+		return offsetof(UiConfig, preheatTemp);
+	}
+	if (field == "tempHist") {
+		return offsetof(UiConfig, tempHist);
+	}
+
+	// stageN.temp, stageN.durationHr, stageN.durationMin with N from 1
+	auto stage = 0;
+	char member[16] = {};
+	if (std::sscanf(field.c_str(), "stage%d.%15s", &stage, member) != 2 ||
+		stage < 1 || stage > 3) {
+		return -1;
+	}
+	auto const base = static_cast<int>(offsetof(UiConfig, stages) +
+									   (stage - 1) * sizeof(UiStage));
+	auto const name = std::string{member};
+	if (name == "temp") {
+		return base + offsetof(UiStage, temp);
+	}
+	if (name == "durationHr") {
+		return base + offsetof(UiStage, durationHr);
+	}
+	if (name == "durationMin") {
+		return base + offsetof(UiStage, durationMin);
+	}
+	return -1;
+}
+
+auto KincoModel::press(std::string const& button, unsigned long holdMillis)
+	-> bool {
+	auto const bit = buttonOffset(button);
+	if (bit < 0) {
+		return false;
+	}
+	setButton(bit, true);
+	held.push_back({bit, millis() + holdMillis});
+	return true;
+}
+
+auto KincoModel::setConfig(std::string const& field, uint16_t value) -> bool {
+	auto const offset = configOffset(field);
+	if (offset < 0) {
+		return false;
+	}
+	holdingRegs[UI_CONFIG.address + offset / sizeof(uint16_t)] = value;
+	return true;
+}
+
+auto KincoModel::step(unsigned long now) -> void {
+	for (auto it = held.begin(); it != held.end();) {
+		if (now >= it->until) {
+			setButton(it->bit, false);
+			it = held.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+auto KincoModel::setButton(int bit, bool down) -> void {
+	if (UI_MAP.flagCoils) {
+		coils[UI_BUTTONS.address + bit] = down;
+		return;
+	}
+	auto& reg = holdingRegs[UI_BUTTONS.address];
+	reg = static_cast<uint16_t>(down ? reg | 1 << bit : reg & ~(1 << bit));
+}
+
+auto KincoModel::lamps() const -> uint16_t {
+	if (!UI_MAP.flagCoils) {
+		return holdingRegs[UI_LAMPS.address];
+	}
+	auto word = uint16_t{0};
+	for (auto i = 0u; i < UI_LAMPS.count; ++i) {
+		word |= static_cast<uint16_t>(coils[UI_LAMPS.address + i] << i);
+	}
+	return word;
+}
+
+auto KincoModel::screen() const -> uint16_t {
+	return holdingRegs[UI_SCREEN.address];
+}
+
+// Strings are two characters per register, low byte first
+auto KincoModel::text(uint16_t address, uint16_t regs) const -> std::string {
+	auto out = std::string{};
+	auto const end = std::min<size_t>(address + regs, holdingRegs.size());
+	for (auto i = size_t{address}; i < end; ++i) {
+		auto const reg = holdingRegs[i];
+		if (reg == 0) {
+			break;
+		}
+		out += static_cast<char>(reg & 0xFF);
+		if (reg >> 8) {
+			out += static_cast<char>(reg >> 8);
+		}
+	}
+	return out;
+}
+
+auto Script::load(char const* path) -> bool {
+	auto file = std::ifstream{path};
+	if (!file) {
+		return false;
+	}
+
+	auto line = std::string{};
+	while (std::getline(file, line)) {
+		auto in = std::istringstream{line};
+		auto at = 0.0;
+		if (line.empty() || line[0] == '#' || !(in >> at)) {
+			continue;
+		}
+		auto rest = std::string{};
+		std::getline(in >> std::ws, rest);
+		actions.push_back({at, rest});
+	}
+	return true;
+}
+
+auto Script::step(unsigned long now) -> void {
+	while (next < actions.size() && actions[next].at * 1000 <= now) {
+		run(actions[next++].line);
+	}
+}
+
+static auto deviceByName(std::string const& name) -> RtuDevice* {
+	if (name == "hmi") {
+		return &hmi();
+	}
+	if (name == "autonics") {
+		return &autonics();
+	}
+	return nullptr;
+}
+
+auto Script::run(std::string const& line) -> void {
+	auto in = std::istringstream{line};
+	auto command = std::string{};
+	in >> command;
+
+	auto ok = false;
+	if (command == "press") {
+		auto button = std::string{};
+		auto hold = 500ul;
+		in >> button >> hold;
+		ok = hmi().press(button, hold);
+	} else if (command == "config") {
+		auto field = std::string{};
+		auto value = 0u;
+		ok = static_cast<bool>(in >> field >> value) &&
+			 hmi().setConfig(field, static_cast<uint16_t>(value));
+	} else if (command == "fault") {
+		auto name = std::string{};
+		auto kind = std::string{};
+		auto rate = 0.0;
+		in >> name >> kind >> rate;
+		if (auto* device = deviceByName(name)) {
+			ok = kind == "timeout" || kind == "crc";
+			(kind == "timeout" ? device->faults.timeoutRate
+							   : device->faults.crcErrorRate) = rate;
+		}
+	} else if (command == "latency") {
+		auto name = std::string{};
+		auto turnaround = 0ul;
+		auto gap = 0ul;
+		in >> name >> turnaround >> gap;
+		if (auto* device = deviceByName(name)) {
+			device->timing = {turnaround, gap};
+			ok = true;
+		}
+	} else if (command == "heater") {
+		auto how = std::string{};
+		in >> how;
+		ok = how == "ok" || how == "broken";
+		plant().setElementBroken(how == "broken");
+	} else if (command == "expect") {
+		auto const before = failed;
+		ok = expect(in);
+		if (ok && failed != before) {
+			std::fprintf(stderr, "script: %lu %s FAILED\n", millis(),
+						 line.c_str());
+			return;
+		}
+	} else if (command == "show") {
+		devicesReport();
+		ok = true;
+	}
+
+	std::fprintf(stderr, "script: %lu %s%s\n", millis(), line.c_str(),
+				 ok ? "" : " (invalid)");
+}
+
+// False when the line makes no sense, a check that doesn't hold counts
+// in `failed`
+auto Script::expect(std::istringstream& in) -> bool {
+	auto what = std::string{};
+	auto arg = std::string{};
+	in >> what >> arg;
+
+	auto holds = false;
+	if (what == "run" && (arg == "on" || arg == "off")) {
+		holds = plant().heaterRunning() == (arg == "on");
+	} else if (what == "polled" && (arg == "hmi" || arg == "autonics")) {
+		auto const requests = deviceByName(arg)->stats.requests;
+		auto& seen = arg == "hmi" ? polledHmi : polledAutonics;
+		holds = requests > seen;
+		seen = requests;
+	} else {
+		return false;
+	}
+
+	if (!holds) {
+		++failed;
+	}
+	return true;
+}
+
+auto autonics() -> AutonicsModel& {
+	static auto instance = AutonicsModel{};
+	return instance;
+}
+
+auto hmi() -> KincoModel& {
+	static auto instance = KincoModel{};
+	return instance;
+}
+
+static auto script = Script{};
+
+auto scriptFailures() -> unsigned {
+	return script.failures();
+}
+
+static auto startMillis = 0ul;
+
+auto devicesBegin() -> void {
+	startMillis = millis();
+	rtuLink().attach(autonics());
+	rtuLink().attach(hmi());
+
+	if (auto const path = std::getenv("SIM_SCRIPT"); path && *path) {
+		if (!script.load(path)) {
+			std::fprintf(stderr, "script: can't read %s\n", path);
+		}
+	}
+}
+
+auto devicesStep() -> void {
+	auto const now = millis();
+	script.step(now - startMillis);
+	hmi().step(now);
+}
+
+auto devicesReport() -> void {
+	auto const& h = hmi();
+	auto const lamps = h.lamps();
+	auto const strings = [&](auto const member) {
+		return h.text(UI_STRINGS.address + member / sizeof(uint16_t), 20);
+	};
+	std::fprintf(stderr,
+				 "hmi: screen %u - lamps %u%u%u%u%u%u - state \"%s\" - "
+				 "heater \"%s\"\n",
+				 h.screen(), lamps & 1, lamps >> 1 & 1, lamps >> 2 & 1,
+				 lamps >> 3 & 1, lamps >> 4 & 1, lamps >> 5 & 1,
+				 strings(offsetof(UiStrings, state)).c_str(),
+				 strings(offsetof(UiStrings, heaterTemp)).c_str());
+
+	for (auto const* device : {static_cast<RtuDevice const*>(&autonics()),
+							   static_cast<RtuDevice const*>(&hmi())}) {
+		std::fprintf(stderr,
+					 "device %u: %lu requests - %lu bytes - %lu timeouts "
+					 "injected - %lu crc errors injected\n",
+					 device->address(), device->stats.requests,
+					 device->stats.bytes, device->stats.timeouts,
+					 device->stats.crcErrors);
+	}
+}
+
+}  // namespace sim
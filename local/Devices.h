@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "RtuLink.h"
+
+namespace sim {
+
+// Same addresses as src/main.cpp
+constexpr auto HMI_ADDRESS = uint8_t{1};
+constexpr auto AUTONICS_ADDRESS = uint8_t{2};
+
+// Temperature controller, tied to the plant: RUN and SV drive the heater,
+// PV and OUT1 read it back
+struct AutonicsModel : RegisterSlave {
+	AutonicsModel();
+
+   protected:
+	auto beforeRead() -> void override;
+	auto afterWriteRegs(uint16_t, uint16_t) -> void override;
+};
+
+// Kinco panel, laid out as UI_MAP in src/Ui.h
+struct KincoModel : RegisterSlave {
+	KincoModel();
+
+	// Holds the button down for a while, like a finger would
+	auto press(std::string const& button, unsigned long holdMillis) -> bool;
+	// Edits a config field as typed on the config screen, e.g. preheatTemp
+	// or stage2.durationMin
+	auto setConfig(std::string const& field, uint16_t value) -> bool;
+	auto step(unsigned long now) -> void;
+
+	// Packed like Lamps, first field in bit 0
+	auto lamps() const -> uint16_t;
+	auto screen() const -> uint16_t;
+	auto text(uint16_t address, uint16_t regs) const -> std::string;
+
+   private:
+	auto setButton(int bit, bool down) -> void;
+
+	struct Held {
+		int bit;
+		unsigned long until;
+	};
+	std::vector<Held> held;
+};
+
+// Timed actions read from the file in SIM_SCRIPT, one per line:
+//
+//   <seconds> press <button> [hold ms]
+//   <seconds> config <field> <value>
+//   <seconds> fault <hmi|autonics> <timeout|crc> <rate>
+//   <seconds> latency <hmi|autonics> <turnaround us> [inter-byte us]
+//   <seconds> heater <ok|broken>
+//   <seconds> expect run <on|off>
+//   <seconds> expect polled <hmi|autonics>
+//   <seconds> show
+//
+// Seconds are simulated time since start, lines starting with # are
+// comments. `heater broken` keeps the element cold whatever the controller
+// does. `expect run` checks the controller's RUN register, `expect polled`
+// that the firmware talked to the device since the previous check. A failed
+// expectation makes the run exit with an error.
+struct Script {
+	auto load(char const* path) -> bool;
+	auto step(unsigned long now) -> void;
+	auto failures() const -> unsigned { return failed; }
+
+   private:
+	struct Action {
+		double at;
+		std::string line;
+	};
+	auto run(std::string const& line) -> void;
+	auto expect(std::istringstream& in) -> bool;
+
+	std::vector<Action> actions;
+	size_t next = 0;
+	unsigned failed = 0;
+	unsigned long polledHmi = 0;
+	unsigned long polledAutonics = 0;
+};
+
+auto autonics() -> AutonicsModel&;
+auto hmi() -> KincoModel&;
+
+// Attaches the models to the RS485 line and loads the script
+auto devicesBegin() -> void;
+auto devicesStep() -> void;
+auto devicesReport() -> void;
+// Expectations in the script that didn't hold
+auto scriptFailures() -> unsigned;
+
+}  // namespace sim
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdio>
+#include <deque>
 #include <exception>
 #include <iostream>
 
@@ -19,6 +21,14 @@ class HardwareSerial {
 		std::cout << t;
 	}
 
+	template <typename T>
+	void println(T t) {
+		print(t);
+		print('\n');
+	}
+
+	void println() { print('\n'); }
+
 	template <typename... Args>
 	void printf(char const* str, Args... args) {
 		if (!initialized) {
@@ -30,8 +40,23 @@ class HardwareSerial {
 		std::printf(str, args...);
 	}
 
+	int availableForWrite() { return 128; }
+
+	size_t write(char const* buffer, size_t size) {
+		std::cout.write(buffer, size);
+		return size;
+	}
+
+	size_t write(char c) { return write(&c, 1); }
+
+	// Input comes from stdin, without blocking the loop
+	int available();
+	int read();
+	int peek();
+
    private:
 	bool initialized = false;
+	std::deque<char> input;
 };
 
 extern HardwareSerial Serial;
@@ -0,0 +1,128 @@
+#include "Plant.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "Arduino.h"
+
+namespace sim {
+
+Plant::Plant(PlantConfig config)
+	: config{config},
+	  heater{config.ambient},
+	  noise{0.0, config.sensorNoise} {
+	chambers.fill(config.ambient);
+}
+
+auto Plant::setHeater(bool running, int sv) -> void {
+	if (running != this->running || sv != this->sv) {
+		segmentStart = elapsed;
+		reached = false;
+	}
+	this->running = running;
+	this->sv = sv;
+}
+
+auto Plant::chamberTemp(int chamber) const -> double {
+	return chambers[chamber];
+}
+
+auto Plant::chamberForCs(uint8_t pin) const -> int {
+	auto const it = std::find(config.sensorCsPins.begin(),
+							  config.sensorCsPins.end(), pin);
+	if (it == config.sensorCsPins.end()) {
+		return -1;
+	}
+	return static_cast<int>(it - config.sensorCsPins.begin());
+}
+
+auto Plant::max6675Frame(int chamber) -> uint16_t {
+	auto const temp = std::max(0.0, chambers[chamber] + noise(rng));
+	// D14..D3 temperature in 0.25°C, D2 open thermocouple
+	auto const quarters = std::min(4095l, std::lround(temp * 4));
+	return static_cast<uint16_t>(quarters << 3);
+}
+
+auto Plant::fanOn(int chamber) const -> bool {
+	return digitalRead(config.fanPins[chamber]) == LOW;
+}
+
+auto Plant::step(uint64_t us) -> void {
+	auto const dt = us / 1e6;
+
+	// The Autonics runs PID, a PI with anti-windup is close enough here
+	auto const clamp = [](double v) { return std::min(std::max(v, 0.0), 1.0); };
+	if (running) {
+		auto const p = (sv - heater) / config.proportionalBand;
+		output = clamp(p + integral);
+		if (output > 0.0 && output < 1.0) {
+			integral += p * dt / config.integralTime;
+		}
+	} else {
+		output = 0.0;
+		integral = 0.0;
+	}
+
+	auto const power = elementBroken ? 0.0 : config.heaterPower;
+	auto heaterFlow = output * power -
+					  config.heaterLoss * (heater - config.ambient);
+	for (auto i = 0; i < CHAMBERS; ++i) {
+		auto const coupling =
+			config.leakCoupling + (fanOn(i) ? config.fanCoupling : 0.0);
+		auto const flow = coupling * (heater - chambers[i]);
+		heaterFlow -= flow;
+		chambers[i] += dt *
+					   (flow - config.chamberLoss *
+								   (chambers[i] - config.ambient)) /
+					   config.chamberCapacity;
+	}
+	heater += dt * heaterFlow / config.heaterCapacity;
+
+	elapsed += dt;
+	updateMetrics(dt);
+}
+
+auto Plant::updateMetrics(double dt) -> void {
+	for (auto const temp : chambers) {
+		stats.maxChamber = std::max(stats.maxChamber, temp);
+	}
+
+	if (!running) {
+		return;
+	}
+
+	auto const error = heater - sv;
+	if (!reached && error > -1.0) {
+		reached = true;
+		if (stats.preheatSeconds < 0) {
+			stats.preheatSeconds = elapsed - segmentStart;
+		}
+	}
+	if (!reached) {
+		return;
+	}
+
+	stats.maxOvershoot = std::max(stats.maxOvershoot, error);
+	stats.trackingAbsSum += std::abs(error) * dt;
+	stats.trackingSeconds += dt;
+}
+
+auto Plant::report() const -> void {
+	std::fprintf(
+		stderr,
+		"plant: heater %.1f°C sv %d - chambers %.1f %.1f %.1f°C (max %.1f) - "
+		"preheat %.0fs - overshoot %.1f°C - tracking error %.2f°C\n",
+		heater, sv, chambers[0], chambers[1], chambers[2], stats.maxChamber,
+		stats.preheatSeconds, stats.maxOvershoot,
+		stats.trackingSeconds > 0
+			? stats.trackingAbsSum / stats.trackingSeconds
+			: 0.0);
+}
+
+auto plant() -> Plant& {
+	static auto instance = Plant{};
+	return instance;
+}
+
+}  // namespace sim
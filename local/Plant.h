@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <random>
+
+namespace sim {
+
+constexpr auto CHAMBERS = 3;
+
+// Lumped model of the oven: one heater zone driven by the Autonics
+// controller and three chambers that only get heat through their fans (and
+// a bit of leakage). Parameters are rough, tuned so a preheat to 200°C takes
+// around ten minutes like the real oven.
+struct PlantConfig {
+	double ambient = 22.0;             // °C
+	double heaterPower = 9000.0;       // W
+	double heaterCapacity = 20000.0;   // J/°C, air, walls and element
+	double heaterLoss = 12.0;          // W/°C to the room
+	double proportionalBand = 5.0;     // °C, Autonics PI control
+	double integralTime = 200.0;       // s
+	double chamberCapacity = 20000.0;  // J/°C, chamber and load
+	double fanCoupling = 25.0;         // W/°C heater to chamber, fan on
+	double leakCoupling = 1.5;         // W/°C heater to chamber, fan off
+	double chamberLoss = 2.0;          // W/°C chamber to the room
+	double sensorNoise = 0.3;          // °C, standard deviation
+	// Same pins as src/main.cpp, fans are active low
+	std::array<uint8_t, CHAMBERS> fanPins = {26, 27, 14};
+	std::array<uint8_t, CHAMBERS> sensorCsPins = {32, 33, 25};
+};
+
+// How well the heater follows SV. A segment starts whenever SV changes or
+// the controller starts running.
+struct PlantMetrics {
+	double preheatSeconds = -1;  // First time PV got within 1°C of SV
+	double maxOvershoot = 0;     // °C above SV after first reaching it
+	double trackingAbsSum = 0;   // ∫|PV - SV| dt once SV was reached
+	double trackingSeconds = 0;
+	double maxChamber = 0;
+};
+
+struct Plant {
+	explicit Plant(PlantConfig config = {});
+
+	// Written by the Autonics model
+	auto setHeater(bool running, int sv) -> void;
+	auto heaterRunning() const -> bool { return running; }
+	auto heaterOut() const -> bool { return output > 0; }
+	auto heaterSv() const -> int { return sv; }
+	// The controller still drives OUT1 but the element gives no heat
+	auto setElementBroken(bool broken) -> void { elementBroken = broken; }
+
+	auto heaterTemp() const -> double { return heater; }
+	auto chamberTemp(int chamber) const -> double;
+
+	// Chamber index for a MAX6675 chip select pin, -1 when it's not one
+	auto chamberForCs(uint8_t pin) const -> int;
+	// 16 bit MAX6675 frame with the chamber temperature plus sensor noise
+	auto max6675Frame(int chamber) -> uint16_t;
+
+	auto step(uint64_t us) -> void;
+
+	auto metrics() const -> PlantMetrics const& { return stats; }
+	auto report() const -> void;
+
+   private:
+	auto fanOn(int chamber) const -> bool;
+	auto updateMetrics(double dt) -> void;
+
+	PlantConfig config;
+	bool running = false;
+	bool elementBroken = false;
+	int sv = 0;
+	double output = 0;  // 0..1
+	double integral = 0;
+	double heater;
+	std::array<double, CHAMBERS> chambers;
+
+	double elapsed = 0;
+	double segmentStart = 0;
+	bool reached = false;
+	PlantMetrics stats;
+	std::mt19937 rng{42};
+	std::normal_distribution<double> noise;
+};
+
+auto plant() -> Plant&;
+
+}  // namespace sim
@@ -0,0 +1,75 @@
+#include "RS485.h"
+
+#include "RtuLink.h"
+
+RS485Class RS485;
+
+void RS485Class::begin(unsigned long baudrate, uint32_t) {
+	this->baudrate = baudrate;
+	rx.clear();
+}
+
+auto RS485Class::arrived() const -> size_t {
+	if (!receiving) {
+		return 0;
+	}
+	auto const now = micros();
+	auto n = size_t{0};
+	while (n < rx.size() && rx[n].at <= now) {
+		++n;
+	}
+	return n;
+}
+
+int RS485Class::available() {
+	return static_cast<int>(arrived());
+}
+
+int RS485Class::peek() {
+	return arrived() > 0 ? rx.front().value : -1;
+}
+
+int RS485Class::read() {
+	if (arrived() == 0) {
+		return -1;
+	}
+	auto const value = rx.front().value;
+	rx.pop_front();
+	return value;
+}
+
+size_t RS485Class::write(uint8_t b) {
+	return write(&b, 1);
+}
+
+size_t RS485Class::write(uint8_t const* buffer, size_t size) {
+	if (!transmitting) {
+		return 0;  // Driver is off, nothing reaches the line
+	}
+	tx.insert(tx.end(), buffer, buffer + size);
+	return size;
+}
+
+void RS485Class::beginTransmission() {
+	transmitting = true;
+	tx.clear();
+}
+
+void RS485Class::endTransmission() {
+	transmitting = false;
+
+	auto response = std::vector<uint8_t>{};
+	auto timing = sim::RtuTiming{};
+	if (!sim::rtuLink().request(tx, response, timing)) {
+		return;
+	}
+
+	// 10 bits per character, 8N1
+	auto const charMicros = 10 * 1000000ul / baudrate;
+	auto at = uint64_t{micros()} + timing.turnaroundMicros;
+	for (auto const b : response) {
+		at += charMicros;
+		rx.push_back({b, at});
+		at += timing.interByteMicros;
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "Arduino.h"
+
+// Half duplex RS485 port wired to the simulated devices in sim::RtuLink.
+// Bytes written between beginTransmission() and endTransmission() form the
+// request frame, the addressed device's answer then trickles in at the
+// line rate of the virtual clock.
+class RS485Class {
+   public:
+	void begin(unsigned long baudrate, uint32_t config = SERIAL_8N1);
+	void end() {}
+
+	int available();
+	int peek();
+	int read();
+	void flush() {}
+
+	size_t write(uint8_t b);
+	size_t write(uint8_t const* buffer, size_t size);
+
+	void beginTransmission();
+	void endTransmission();
+	void receive() { receiving = true; }
+	void noReceive() { receiving = false; }
+
+   private:
+	struct Incoming {
+		uint8_t value;
+		uint64_t at;  // Virtual micros when the stop bit is in
+	};
+
+	auto arrived() const -> size_t;
+
+	unsigned long baudrate = 9600;
+	bool transmitting = false;
+	bool receiving = false;
+	std::vector<uint8_t> tx;
+	std::deque<Incoming> rx;
+};
+
+extern RS485Class RS485;
@@ -0,0 +1,182 @@
+#include "RtuLink.h"
+
+namespace sim {
+
+constexpr auto EXCEPTION_ILLEGAL_FUNCTION = uint8_t{0x01};
+constexpr auto EXCEPTION_ILLEGAL_ADDRESS = uint8_t{0x02};
+constexpr auto EXCEPTION_ILLEGAL_VALUE = uint8_t{0x03};
+
+auto rtuCrc(uint8_t const* data, size_t len) -> uint16_t {
+	auto crc = uint16_t{0xFFFF};
+	for (auto i = size_t{0}; i < len; ++i) {
+		crc ^= data[i];
+		for (auto bit = 0; bit < 8; ++bit) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+static auto getU16(std::vector<uint8_t> const& data, size_t at) -> uint16_t {
+	return static_cast<uint16_t>(data[at] << 8 | data[at + 1]);
+}
+
+static auto putU16(std::vector<uint8_t>& data, uint16_t value) -> void {
+	data.push_back(static_cast<uint8_t>(value >> 8));
+	data.push_back(static_cast<uint8_t>(value & 0xFF));
+}
+
+static auto exception(std::vector<uint8_t>& response,
+					  uint8_t function,
+					  uint8_t code) -> bool {
+	response = {static_cast<uint8_t>(function | 0x80), code};
+	return true;
+}
+
+RegisterSlave::RegisterSlave(uint8_t address,
+							 size_t coils,
+							 size_t discreteInputs,
+							 size_t holdingRegs,
+							 size_t inputRegs)
+	: coils(coils),
+	  discreteInputs(discreteInputs),
+	  holdingRegs(holdingRegs),
+	  inputRegs(inputRegs),
+	  slaveAddress{address} {}
+
+auto RegisterSlave::handle(std::vector<uint8_t> const& request,
+						   std::vector<uint8_t>& response) -> bool {
+	auto const function = request[0];
+	if (request.size() < 5) {
+		return exception(response, function, EXCEPTION_ILLEGAL_VALUE);
+	}
+	auto const addr = getU16(request, 1);
+	auto const count = getU16(request, 3);
+
+	auto const readBits = [&](std::vector<uint8_t> const& table) {
+		if (count == 0 || addr + count > table.size()) {
+			return exception(response, function, EXCEPTION_ILLEGAL_ADDRESS);
+		}
+		beforeRead();
+		response = {function, static_cast<uint8_t>((count + 7) / 8)};
+		response.resize(2 + response[1]);
+		for (auto i = 0u; i < count; ++i) {
+			if (table[addr + i]) {
+				response[2 + i / 8] |= static_cast<uint8_t>(1 << (i % 8));
+			}
+		}
+		return true;
+	};
+
+	auto const readRegs = [&](std::vector<uint16_t> const& table) {
+		if (count == 0 || addr + count > table.size()) {
+			return exception(response, function, EXCEPTION_ILLEGAL_ADDRESS);
+		}
+		beforeRead();
+		response = {function, static_cast<uint8_t>(count * 2)};
+		for (auto i = 0u; i < count; ++i) {
+			putU16(response, table[addr + i]);
+		}
+		return true;
+	};
+
+	switch (function) {
+	case 0x01: return readBits(coils);
+	case 0x02: return readBits(discreteInputs);
+	case 0x03: return readRegs(holdingRegs);
+	case 0x04: return readRegs(inputRegs);
+	case 0x06:
+		if (addr >= holdingRegs.size()) {
+			return exception(response, function, EXCEPTION_ILLEGAL_ADDRESS);
+		}
+		holdingRegs[addr] = count;  // The value sits where count would
+		afterWriteRegs(addr, 1);
+		response = request;
+		return true;
+	case 0x0F:
+		if (addr + count > coils.size() ||
+			request.size() < 6 + (count + 7) / 8u) {
+			return exception(response, function, EXCEPTION_ILLEGAL_ADDRESS);
+		}
+		for (auto i = 0u; i < count; ++i) {
+			coils[addr + i] = (request[6 + i / 8] >> (i % 8)) & 1;
+		}
+		afterWriteCoils(addr, count);
+		response.assign(request.begin(), request.begin() + 5);
+		return true;
+	case 0x10:
+		if (addr + count > holdingRegs.size() ||
+			request.size() < 6 + count * 2u) {
+			return exception(response, function, EXCEPTION_ILLEGAL_ADDRESS);
+		}
+		for (auto i = 0u; i < count; ++i) {
+			holdingRegs[addr + i] = getU16(request, 6 + i * 2);
+		}
+		afterWriteRegs(addr, count);
+		response.assign(request.begin(), request.begin() + 5);
+		return true;
+	default: return exception(response, function, EXCEPTION_ILLEGAL_FUNCTION);
+	}
+}
+
+auto RtuLink::attach(RtuDevice& device) -> void {
+	devices.push_back(&device);
+}
+
+auto RtuLink::chance(double rate) -> bool {
+	return rate > 0 && std::uniform_real_distribution<double>{}(rng) < rate;
+}
+
+auto RtuLink::request(std::vector<uint8_t> const& frame,
+					  std::vector<uint8_t>& response,
+					  RtuTiming& timing) -> bool {
+	if (frame.size() < 4) {
+		return false;
+	}
+	auto const len = frame.size() - 2;
+	auto const crc = rtuCrc(frame.data(), len);
+	if (frame[len] != (crc & 0xFF) || frame[len + 1] != (crc >> 8)) {
+		return false;
+	}
+
+	for (auto* device : devices) {
+		if (device->address() != frame[0]) {
+			continue;
+		}
+
+		++device->stats.requests;
+		device->stats.bytes += frame.size();
+		if (chance(device->faults.timeoutRate)) {
+			++device->stats.timeouts;
+			return false;
+		}
+
+		auto const pdu = std::vector<uint8_t>(frame.begin() + 1,
+											  frame.begin() + len);
+		auto answer = std::vector<uint8_t>{};
+		if (!device->handle(pdu, answer)) {
+			return false;
+		}
+
+		response.assign(1, frame[0]);
+		response.insert(response.end(), answer.begin(), answer.end());
+		auto const out = rtuCrc(response.data(), response.size());
+		response.push_back(static_cast<uint8_t>(out & 0xFF));
+		response.push_back(static_cast<uint8_t>(out >> 8));
+		if (chance(device->faults.crcErrorRate)) {
+			++device->stats.crcErrors;
+			response.back() ^= 0xFF;
+		}
+		device->stats.bytes += response.size();
+		timing = device->timing;
+		return true;
+	}
+	return false;
+}
+
+auto rtuLink() -> RtuLink& {
+	static auto instance = RtuLink{};
+	return instance;
+}
+
+}  // namespace sim
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace sim {
+
+auto rtuCrc(uint8_t const* data, size_t len) -> uint16_t;
+
+struct RtuTiming {
+	unsigned long turnaroundMicros = 2000;  // End of request to first byte
+	unsigned long interByteMicros = 0;      // Extra gap between bytes
+};
+
+// Chances per request, decided by a seeded generator so runs repeat
+struct RtuFaults {
+	double timeoutRate = 0;   // No answer at all
+	double crcErrorRate = 0;  // Answer with a corrupted CRC
+};
+
+struct RtuDeviceStats {
+	unsigned long requests = 0;
+	unsigned long bytes = 0;  // Requests and answers on the line
+	unsigned long timeouts = 0;
+	unsigned long crcErrors = 0;
+};
+
+// Something on the simulated RS485 line
+struct RtuDevice {
+	virtual ~RtuDevice() = default;
+
+	virtual auto address() const -> uint8_t = 0;
+
+	// Request PDU without the address and CRC. Fills the response PDU and
+	// returns false to stay silent.
+	virtual auto handle(std::vector<uint8_t> const& request,
+						std::vector<uint8_t>& response) -> bool = 0;
+
+	RtuTiming timing;
+	RtuFaults faults;
+	RtuDeviceStats stats;
+};
+
+// Standard Modbus slave over four plain tables. Models override the hooks to
+// tie registers to the simulation.
+struct RegisterSlave : RtuDevice {
+	RegisterSlave(uint8_t address,
+				  size_t coils,
+				  size_t discreteInputs,
+				  size_t holdingRegs,
+				  size_t inputRegs);
+
+	auto address() const -> uint8_t override { return slaveAddress; }
+	auto handle(std::vector<uint8_t> const& request,
+				std::vector<uint8_t>& response) -> bool override;
+
+	std::vector<uint8_t> coils;
+	std::vector<uint8_t> discreteInputs;
+	std::vector<uint16_t> holdingRegs;
+	std::vector<uint16_t> inputRegs;
+
+   protected:
+	// Before any read, to refresh inputs from the simulation
+	virtual auto beforeRead() -> void {}
+	// After the master wrote [address, address + count)
+	virtual auto afterWriteRegs(uint16_t, uint16_t) -> void {}
+	virtual auto afterWriteCoils(uint16_t, uint16_t) -> void {}
+
+   private:
+	uint8_t slaveAddress;
+};
+
+// The devices on the line, RS485Class delivers every request frame here
+struct RtuLink {
+	auto attach(RtuDevice& device) -> void;
+
+	// Full frames with address and CRC. Bad CRCs and unknown addresses get
+	// no answer, like on a real line.
+	auto request(std::vector<uint8_t> const& frame,
+				 std::vector<uint8_t>& response,
+				 RtuTiming& timing) -> bool;
+
+   private:
+	auto chance(double rate) -> bool;
+
+	std::vector<RtuDevice*> devices;
+	std::mt19937 rng{7};
+};
+
+auto rtuLink() -> RtuLink&;
+
+}  // namespace sim
@@ -0,0 +1,37 @@
+#include "SPI.h"
+
+#include <array>
+
+#include "Plant.h"
+
+// The MAX6675 starts converting when deselected and needs up to 220ms. A
+// chip read earlier than that answers with the last finished conversion.
+constexpr auto MAX6675_CONVERSION_MICROS = 220000ul;
+
+struct Max6675 {
+	uint16_t frame = 0;
+	unsigned long convertedAt = 0;
+};
+
+static auto chips = std::array<Max6675, sim::CHAMBERS>{};
+
+uint16_t SPIClass::transfer16(uint16_t) {
+	auto& plant = sim::plant();
+	for (auto pin = 0; pin < 256; ++pin) {
+		auto const chamber = plant.chamberForCs(static_cast<uint8_t>(pin));
+		if (chamber < 0 || digitalRead(static_cast<uint8_t>(pin)) != LOW) {
+			continue;
+		}
+
+		auto& chip = chips[chamber];
+		auto const now = micros();
+		if (chip.convertedAt == 0 ||
+			now - chip.convertedAt >= MAX6675_CONVERSION_MICROS) {
+			chip.frame = plant.max6675Frame(chamber);
+			chip.convertedAt = now;
+		}
+		return chip.frame;
+	}
+
+	return 0xFFFF;  // Nobody selected, MISO floats high
+}
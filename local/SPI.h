@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Arduino.h"
+
+constexpr auto HSPI = 2;
+constexpr auto VSPI = 3;
+
+constexpr auto SPI_LSBFIRST = 0;
+constexpr auto SPI_MSBFIRST = 1;
+
+constexpr auto SPI_MODE0 = 0;
+constexpr auto SPI_MODE1 = 1;
+constexpr auto SPI_MODE2 = 2;
+constexpr auto SPI_MODE3 = 3;
+
+class SPISettings {
+   public:
+	SPISettings(uint32_t clock = 1000000,
+				uint8_t bitOrder = SPI_MSBFIRST,
+				uint8_t dataMode = SPI_MODE0)
+		: clock{clock}, bitOrder{bitOrder}, dataMode{dataMode} {}
+
+	uint32_t clock;
+	uint8_t bitOrder;
+	uint8_t dataMode;
+};
+
+// The only devices on the bus are the MAX6675 chips of the simulated plant,
+// whichever has its chip select low answers
+class SPIClass {
+   public:
+	explicit SPIClass(uint8_t bus = VSPI) : bus{bus} {}
+
+	void begin() {}
+	void end() {}
+	void beginTransaction(SPISettings) {}
+	void endTransaction() {}
+
+	uint16_t transfer16(uint16_t data);
+
+   private:
+	uint8_t bus;
+};
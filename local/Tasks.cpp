@@ -0,0 +1,139 @@
+#include "Tasks.h"
+
+#include <atomic>
+#include <cstdio>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "Arduino.h"
+#include "freertos/task.h"
+
+// FreeRTOS tasks on std::thread. A task runs until it calls vTaskDelay(),
+// the main loop waits for all of them to get there before it moves the
+// virtual clock, and then wakes the ones that are due. Tasks due in the
+// same step run at the same time, like on the two cores, so their
+// interleaving is up to the OS and ThreadSanitizer gets to see it.
+//
+// The hand-offs happen every simulated millisecond, so both sides spin on
+// atomics instead of sleeping on condition variables, which made a roast
+// run several times slower.
+
+namespace {
+
+struct Task {
+	TaskFunction_t function;
+	void* param;
+	char const* name;
+	uint64_t wakeAt = 0;
+	std::atomic<bool> ready{true};
+	std::thread thread = {};
+};
+
+// Unwinds a task when the simulation ends
+struct TaskStopped {};
+
+// Only guards the task list while tasks are created
+std::mutex mutex;
+std::list<Task> tasks;
+std::atomic<int> running{0};
+std::atomic<bool> stopping{false};
+bool loopGone = false;
+thread_local Task* current = nullptr;
+
+auto run(Task& task) -> void {
+	current = &task;
+	sim::clockResume();
+	try {
+		task.function(task.param);
+		std::fprintf(stderr, "sim: task %s returned\n", task.name);
+	} catch (TaskStopped const&) {
+		return;
+	}
+	// A FreeRTOS task must not return, keep the count right anyway
+	running.fetch_sub(1, std::memory_order_release);
+}
+
+}  // namespace
+
+auto xTaskCreatePinnedToCore(TaskFunction_t function,
+							 char const* name,
+							 uint32_t,
+							 void* param,
+							 UBaseType_t,
+							 TaskHandle_t* handle,
+							 BaseType_t) -> BaseType_t {
+	auto lock = std::lock_guard{mutex};
+	auto& task = tasks.emplace_back();
+	task.function = function;
+	task.param = param;
+	task.name = name;
+	running.fetch_add(1, std::memory_order_relaxed);
+	task.thread = std::thread{[&task] { run(task); }};
+	if (handle) {
+		*handle = &task;
+	}
+	return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+	if (!current) {
+		// Not a task, the main loop just waits like delay() does
+		delay(ticks * portTICK_PERIOD_MS);
+		return;
+	}
+
+	current->wakeAt =
+		sim::clockMicros() + uint64_t{ticks} * portTICK_PERIOD_MS * 1000;
+	current->ready.store(false, std::memory_order_relaxed);
+	running.fetch_sub(1, std::memory_order_release);
+	while (!current->ready.load(std::memory_order_acquire)) {
+		if (stopping.load(std::memory_order_acquire)) {
+			throw TaskStopped{};
+		}
+		std::this_thread::yield();
+	}
+	sim::clockResume();
+}
+
+void vTaskDelete(TaskHandle_t task) {
+	if (task || current) {
+		std::fprintf(stderr, "sim: only the loop task can be deleted\n");
+		std::terminate();
+	}
+	loopGone = true;
+}
+
+namespace sim {
+
+auto tasksSettle() -> void {
+	while (running.load(std::memory_order_acquire) != 0) {
+		std::this_thread::yield();
+	}
+}
+
+// Only called settled, so no task is touching its wakeAt
+auto tasksRelease(uint64_t nowMicros) -> void {
+	auto lock = std::lock_guard{mutex};
+	for (auto& task : tasks) {
+		if (!task.ready.load(std::memory_order_relaxed) &&
+			task.wakeAt <= nowMicros) {
+			running.fetch_add(1, std::memory_order_relaxed);
+			task.ready.store(true, std::memory_order_release);
+		}
+	}
+}
+
+auto tasksStop() -> void {
+	tasksSettle();
+	stopping.store(true, std::memory_order_release);
+	for (auto& task : tasks) {
+		task.thread.join();
+	}
+}
+
+auto loopDeleted() -> bool {
+	return loopGone;
+}
+
+}  // namespace sim
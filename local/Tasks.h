@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+namespace sim {
+
+// Hooks for the main loop in Arduino.cpp, which owns the virtual clock.
+// Time only moves once every task is blocked in vTaskDelay().
+auto tasksSettle() -> void;
+auto tasksRelease(uint64_t nowMicros) -> void;
+auto tasksStop() -> void;
+
+// The virtual clock alone. micros() adds the wall time the calling thread
+// has been running since clockResume() when the bench switched that on.
+auto clockMicros() -> uint64_t;
+auto clockResume() -> void;
+
+// The firmware deleted its loop task, loop() isn't called anymore
+auto loopDeleted() -> bool;
+
+}  // namespace sim
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+// The part of Arduino's String the firmware uses, backed by std::string
+class String {
+   public:
+	String() = default;
+	String(char const* str) : str{str ? str : ""} {}
+	explicit String(double value, unsigned decimals = 2) {
+		char buf[32];
+		std::snprintf(buf, sizeof(buf), "%.*f", static_cast<int>(decimals),
+					  value);
+		str = buf;
+	}
+
+	auto operator+=(String const& other) -> String& {
+		str += other.str;
+		return *this;
+	}
+
+	auto operator+=(char const* other) -> String& {
+		str += other;
+		return *this;
+	}
+
+	// Like Arduino, a char is appended as is and other numbers as text
+	template <class T, class = std::enable_if_t<std::is_arithmetic_v<T>>>
+	auto operator+=(T value) -> String& {
+		if constexpr (std::is_same_v<T, char>) {
+			str += value;
+		} else if constexpr (std::is_floating_point_v<T>) {
+			*this += String{static_cast<double>(value)};
+		} else {
+			str += std::to_string(value);
+		}
+		return *this;
+	}
+
+	auto operator==(char const* other) const -> bool { return str == other; }
+
+	auto c_str() const -> char const* { return str.c_str(); }
+	auto length() const -> unsigned { return str.size(); }
+	auto clear() -> void { str.clear(); }
+
+   private:
+	std::string str;
+};
+
+inline auto operator+(String lhs, String const& rhs) -> String {
+	return lhs += rhs;
+}
+
+inline auto operator+(String lhs, char const* rhs) -> String {
+	return lhs += rhs;
+}
+
+inline auto operator+(char const* lhs, String const& rhs) -> String {
+	return String{lhs} += rhs;
+}
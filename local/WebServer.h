@@ -0,0 +1,22 @@
+#pragma once
+
+#include <functional>
+
+#include "Arduino.h"
+
+// Routes are registered but nothing listens, the web UI is not served on the
+// host
+class WebServer {
+   public:
+	explicit WebServer(int port) : port{port} {}
+
+	void on(char const*, std::function<void()>) {}
+	void begin() {}
+	void handleClient() {}
+	void send(int, char const*, String const&) {}
+	bool hasArg(char const*) { return false; }
+	String arg(char const*) { return {}; }
+
+   private:
+	int port;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "Arduino.h"
+
+constexpr auto WIFI_STA = 1;
+constexpr auto WL_CONNECTED = 3;
+
+// No network on the host, it just reports being connected
+class IPAddress {
+   public:
+	String toString() const { return "127.0.0.1"; }
+};
+
+class WiFiClass {
+   public:
+	void mode(int) {}
+	void begin(char const*, char const*) {}
+	int status() { return WL_CONNECTED; }
+	IPAddress localIP() { return {}; }
+};
+
+inline WiFiClass WiFi;
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+using BaseType_t = int;
+using UBaseType_t = unsigned;
+using TickType_t = uint32_t;
+
+constexpr auto pdPASS = BaseType_t{1};
+constexpr auto pdFAIL = BaseType_t{0};
+constexpr auto portTICK_PERIOD_MS = TickType_t{1};
+constexpr auto portMAX_DELAY = TickType_t{0xFFFFFFFF};
+
+#define pdMS_TO_TICKS(ms) (static_cast<TickType_t>(ms) / portTICK_PERIOD_MS)
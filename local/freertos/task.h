@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks are threads, see local/Tasks.cpp. Cores and priorities are only
+// there to match the ESP32 signature.
+using TaskFunction_t = void (*)(void*);
+using TaskHandle_t = void*;
+
+auto xTaskCreatePinnedToCore(TaskFunction_t task,
+							 char const* name,
+							 uint32_t stackDepth,
+							 void* param,
+							 UBaseType_t priority,
+							 TaskHandle_t* handle,
+							 BaseType_t core) -> BaseType_t;
+
+// Blocks the calling task until the virtual clock moved on by ticks
+void vTaskDelay(TickType_t ticks);
+
+// Only deleting the Arduino loop task (nullptr from loop()) is supported
+void vTaskDelete(TaskHandle_t task);
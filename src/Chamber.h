@@ -9,4 +9,13 @@ using kev::TempSensor;
 struct Chamber {
 	TempSensor sensor;
 	Output fan;
+	unsigned long fanToggles = 0;
+
+	// Counts the relay actually switching, to spot chatter
+	auto setFan(bool on) -> void {
+		if (fan.read() != on) {
+			++fanToggles;
+		}
+		fan.write(on);
+	}
 };
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <optional>
+
+#include "ConfigCommon.h"
+#include "kev/Log.h"
+#include "kev/SeqLock.h"
+#include "kev/Spsc.h"
+#include "kev/TempSensor.h"
+#include "kev/Time.h"
+
+// What the control task tells the comms task and the other way around. The
+// control task owns the sensors, outputs and MainImpl. The comms task owns
+// the bus, the panel, serial and web, and only gets to see the control side
+// through this.
+
+constexpr auto MAIN_COMMAND_QUEUE = 16;
+// Sensor statistics and the config change slowly and only show up on
+// request, they're published at this rate and after every command
+constexpr auto MAIN_DETAILS_PERIOD = kev::Duration{250};
+
+// Button presses go through UiEvents, this is the rest
+enum class MainCommandKind {
+	SetConfig,
+	ForceTemp,
+	UnforceTemps,
+};
+
+struct MainCommand {
+	MainCommandKind kind;
+	Config config = {};  // SetConfig
+	int chamber = 0;     // ForceTemp, from 0
+	double temp = 0;     // ForceTemp
+};
+
+using MainCommandQueue = kev::SpscQueue<MainCommand, MAIN_COMMAND_QUEUE>;
+
+struct ChamberStatus {
+	std::optional<float> temp = {};
+	bool fan = false;
+	bool forced = false;
+};
+
+// What the front-ends render, published by the control task after every
+// tick. Renderers take one copy and format everything from it, so the
+// panel, serial and web never disagree and never touch the hardware. Kept
+// small, the seqlock copies it on every tick.
+struct MainStatus {
+	unsigned long version = 0;  // Counts publishes
+	kev::Timestamp at = {};
+	MainState state = MainState::Idle;
+	bool heater = false;
+	bool heaterAlarm = false;
+	bool overrunAlarm = false;  // The control tick keeps missing its budget
+	bool rotation = false;
+	bool rotationBw = false;
+	std::optional<float> heaterTemp = {};
+	std::optional<kev::Duration> timer = {};
+	std::array<ChamberStatus, 3> chambers = {};
+};
+
+struct ChamberDetails {
+	unsigned long fanToggles = 0;
+	kev::TempSensorStats sensor = {};
+};
+
+// The slow moving rest, every MAIN_DETAILS_PERIOD
+struct MainDetails {
+	unsigned long version = 0;
+	kev::Timestamp at = {};
+	Config config = {};
+	std::array<ChamberDetails, 3> chambers = {};
+};
+
+inline auto mainStateStr(MainState state) -> char const* {
+	switch (state) {
+	case MainState::Idle: return "Idle";
+	case MainState::Preheating: return "Preheating";
+	case MainState::Stage1: return "Stage1";
+	case MainState::Stage2: return "Stage2";
+	case MainState::Stage3: return "Stage3";
+	default: return "Unknown";
+	}
+}
+
+// What the panel shows
+inline auto mainStateDisplay(MainState state) -> char const* {
+	switch (state) {
+	case MainState::Idle: return "Detenido";
+	case MainState::Preheating: return "Precalentando";
+	case MainState::Stage1: return "Etapa Inicial";
+	case MainState::Stage2: return "Etapa Intermedia";
+	case MainState::Stage3: return "Etapa Final";
+	default: return "Desconocido";
+	}
+}
+
+template <typename = void>
+struct ControlLinkImpl {
+	// Comms side. Commands are applied on the next control tick.
+	auto post(MainCommand const& command) -> bool {
+		if (!commands.push(command)) {
+			log.warn("command queue full, dropped ",
+					 static_cast<int>(command.kind));
+			return false;
+		}
+		return true;
+	}
+
+	auto read() const -> MainStatus { return status.read(); }
+	auto readDetails() const -> MainDetails { return details.read(); }
+
+	// Control side
+	auto nextCommand() -> std::optional<MainCommand> { return commands.pop(); }
+
+	auto publish(MainStatus st) -> void {
+		st.version = ++statusVersion;
+		status.write(st);
+	}
+
+	auto publishDetails(MainDetails d) -> void {
+		d.version = ++detailsVersion;
+		details.write(d);
+	}
+
+	auto commandQueue() const -> MainCommandQueue const& { return commands; }
+
+   private:
+	MainCommandQueue commands;
+	kev::SeqLock<MainStatus> status;
+	kev::SeqLock<MainDetails> details;
+	unsigned long statusVersion = 0;  // Control side only
+	unsigned long detailsVersion = 0;
+	kev::Log<> log{"link"};
+};
+
+using ControlLink = ControlLinkImpl<>;
@@ -8,8 +8,10 @@
 
 #include "Chamber.h"
 #include "ConfigCommon.h"
+#include "ControlLink.h"
 #include "Rotation.h"
 #include "State.h"
+#include "UiEvents.h"
 #include "kev/AutonicsTempController.h"
 #include "kev/Log.h"
 #include "kev/Pin.h"
@@ -35,6 +37,23 @@ using Heater = kev::RepeatedOutput<2>;
 
 constexpr auto HEATER_FAILURE_TIMEOUT = 2_min;
 constexpr auto HEATER_FAILURE_TEMP_DIFF = 2.0;
+// Oldest controller reading we still act on
+constexpr auto HEATER_PV_MAX_AGE = 5_s;
+
+// When the heater output is on but the temperature doesn't rise, the
+// controller is stopped for offTime and started again. After maxRetries
+// failed retries in a row the heater is left off and an alarm is latched
+// until the roast is stopped or started again.
+struct HeaterRecoveryConfig {
+	Duration offTime = 1_s;
+	int maxRetries = 3;
+};
+
+enum class HeaterRecovery {
+	Monitoring,
+	Off,
+	Alarm,
+};
 
 enum class RotationState {
 	Normal,
@@ -47,11 +66,15 @@ struct MainImpl {
 	MainImpl(array<Chamber, 3>& chambers,
 			 Rotation& rotation,
 			 AutonicsTempController& tempController,
-			 State& persistent)
-		: chambers{chambers},
+			 State& persistent,
+			 UiEvents& events,
+			 HeaterRecoveryConfig recovery = {})
+		: recovery{recovery},
+		  chambers{chambers},
 		  rotation{rotation},
 		  tempController{tempController},
-		  persistent{persistent} {}
+		  persistent{persistent},
+		  events{events} {}
 
 	auto setConfig(Config cfg) -> void {
 		preheatTemp = cfg.preheatTemp;
@@ -92,6 +115,11 @@ struct MainImpl {
 	auto setPreheatTemp(double temp) -> void { preheatTemp = temp; }
 
 	auto tick(Timestamp now) -> void {
+		// Everything the front-ends posted since the last tick, in order
+		while (auto const event = events.next(now)) {
+			handleEvent(*event, now);
+		}
+
 		if (state != prevState) {
 			processStateChange(now);
 		}
@@ -103,7 +131,10 @@ struct MainImpl {
 
 	auto eventUiPreheat(Timestamp now) -> void {
 		switch (state) {
-		case MainState::Idle: changeState(MainState::Preheating, now); break;
+		case MainState::Idle:
+			clearHeaterAlarm();
+			changeState(MainState::Preheating, now);
+			break;
 		case MainState::Preheating:
 		case MainState::Stage1:
 		case MainState::Stage2:
@@ -111,6 +142,7 @@ struct MainImpl {
 		}
 	}
 	auto eventUiStop(Timestamp now) -> void {
+		clearHeaterAlarm();
 		changeState(MainState::Idle, now);
 	}
 
@@ -123,6 +155,7 @@ struct MainImpl {
 	auto eventUiStart(Timestamp now) -> void {
 		switch (state) {
 		case MainState::Idle:
+			clearHeaterAlarm();
 			if (!pauseData) {
 				log("start without pause data");
 				changeState(MainState::Stage1, now);
@@ -150,30 +183,12 @@ struct MainImpl {
 		rotationState = RotationState::Normal;
 	}
 
-	auto stateStr(MainState state) -> char const* {
-		switch (state) {
-		case MainState::Idle: return "Idle";
-		case MainState::Preheating: return "Preheating";
-		case MainState::Stage1: return "Stage1";
-		case MainState::Stage2: return "Stage2";
-		case MainState::Stage3: return "Stage3";
-		}
-		return "Unknown";
-	}
-
-	auto displayState() -> char const* {
-		switch (state) {
-		case MainState::Idle: return "Detenido";
-		case MainState::Preheating: return "Precalentando";
-		case MainState::Stage1: return "Etapa Inicial";
-		case MainState::Stage2: return "Etapa Intermedia";
-		case MainState::Stage3: return "Etapa Final";
-		}
-		return "Desconocido";
-	}
-
-	auto readStateStr() -> char const* { return stateStr(state); }
+	auto readStateStr() -> char const* { return mainStateStr(state); }
+	auto displayState() -> char const* { return mainStateDisplay(state); }
 	auto readHeater(Timestamp) -> bool { return tempController.isRunning(); }
+	auto readHeaterAlarm() -> bool {
+		return heaterRecovery == HeaterRecovery::Alarm;
+	}
 	auto readFan(int i) -> bool { return chambers[i].fan.read(); }
 	auto readTemp(int i, Timestamp now) -> optional<double> {
 		return chambers[i].sensor.getTemp(now);
@@ -192,54 +207,148 @@ struct MainImpl {
 	}
 
 	auto heaterTemp(Timestamp now) -> optional<double> {
-		auto const temp = tempController.readPv(now);
+		auto const temp = tempController.readPv(now, HEATER_PV_MAX_AGE);
 		if (!temp) {
-			log("failed to read temp, falling back to sensor temp");
+			log.debug("failed to read temp, falling back to sensor temp");
 			return minTemp(now);
 		}
-		chambers[0].sensor.forceTemp(*temp + 10);
-		chambers[1].sensor.forceTemp(*temp +  5);
-		chambers[2].sensor.forceTemp(*temp - 10);
 		return *temp;
 	}
 
+	// Runs a command from the comms task, on the control task
+	auto apply(MainCommand const& command, Timestamp) -> void {
+		switch (command.kind) {
+		case MainCommandKind::SetConfig:
+			setConfig(command.config);
+			persistent.inner.config = command.config;
+			persistent.persist();
+			break;
+		case MainCommandKind::ForceTemp:
+			chambers[command.chamber].sensor.forceTemp(command.temp);
+			break;
+		case MainCommandKind::UnforceTemps:
+			for (auto& ch : chambers) {
+				ch.sensor.unforceTemp();
+			}
+			break;
+		}
+	}
+
+	// Everything the front-ends show, from what this tick already knows
+	auto status(Timestamp now) -> MainStatus {
+		auto st = MainStatus{
+			.at = now,
+			.state = state,
+			.heater = readHeater(now),
+			.heaterAlarm = readHeaterAlarm(),
+			.rotation = readRotation(),
+			.rotationBw = readRotationDir(),
+			.heaterTemp = toFloat(heaterTemp(now)),
+			.timer = readCurrentTimer(now),
+		};
+		for (auto i = 0; i < 3; ++i) {
+			st.chambers[i] = ChamberStatus{
+				.temp = toFloat(readTemp(i, now)),
+				.fan = readFan(i),
+				.forced = chambers[i].sensor.isForced(),
+			};
+		}
+		return st;
+	}
+
+	auto details(Timestamp now) -> MainDetails {
+		auto d = MainDetails{.at = now, .config = getConfig()};
+		for (auto i = 0; i < 3; ++i) {
+			d.chambers[i] = ChamberDetails{
+				.fanToggles = chambers[i].fanToggles,
+				.sensor = chambers[i].sensor.sampleStats(),
+			};
+		}
+		return d;
+	}
+
    private:
+	static auto toFloat(optional<double> value) -> optional<float> {
+		if (!value) {
+			return {};
+		}
+		return static_cast<float>(*value);
+	}
+
+	auto handleEvent(UiEvent const& event, Timestamp now) -> void {
+		log.debug(uiEventKindStr(event.kind), " from ",
+				  uiSourceStr(event.source));
+		switch (event.kind) {
+		case UiEventKind::Preheat: eventUiPreheat(now); break;
+		case UiEventKind::Start: eventUiStart(now); break;
+		case UiEventKind::Stop: eventUiStop(now); break;
+		case UiEventKind::Pause: eventUiPause(now); break;
+		case UiEventKind::RotateFw: eventUiRotateFw(); break;
+		case UiEventKind::RotateFwStop: eventUiRotateFwStop(); break;
+		case UiEventKind::RotateBw: eventUiRotateBw(); break;
+		case UiEventKind::RotateBwStop: eventUiRotateBwStop(); break;
+		}
+	}
+
 	auto changeState(MainState newState, Timestamp now) -> void {
 		state = newState;
 		processStateChange(now);
 	}
 
 	auto processStateChange(Timestamp now) -> void {
-		log("state change: ", stateStr(prevState), " -> ", stateStr(state));
+		log("state change: ", mainStateStr(prevState), " -> ",
+			mainStateStr(state));
 
 		applyHeaterTemperature();
 
 		switch (state) {
 		case MainState::Idle:
 			tempController.setRun(false);
+			if (heaterRecovery == HeaterRecovery::Off) {
+				heaterRecovery = HeaterRecovery::Monitoring;
+			}
 			for_each(chambers.begin(), chambers.end(),
-					 [](Chamber& ch) { ch.fan.write(false); });
+					 [](Chamber& ch) { ch.setFan(false); });
 			rotation.stop();
 			break;
-		case MainState::Preheating: tempController.setRun(true); break;
+		case MainState::Preheating: startHeater(); break;
 		case MainState::Stage1:
-			tempController.setRun(true);
+			startHeater();
 			rotation.start_fw();
 			stage1Timer.reset(now);
 			break;
 		case MainState::Stage2:
-			tempController.setRun(true);
+			startHeater();
 			rotation.start_fw();
 			stage2Timer.reset(now);
 			break;
 		case MainState::Stage3:
-			tempController.setRun(true);
+			startHeater();
 			rotation.start_fw();
 			stage3Timer.reset(now);
 			break;
 		}
 	}
 
+	// Stop and every deliberate (re)start give the heater a fresh chance,
+	// otherwise startHeater() would quietly skip it on the next roast
+	auto clearHeaterAlarm() -> void {
+		if (heaterRecovery == HeaterRecovery::Alarm) {
+			log("heater alarm cleared");
+			heaterRecovery = HeaterRecovery::Monitoring;
+		}
+		heaterRetries = 0;
+	}
+
+	// The recovery sequence owns the heater while it runs, and a latched
+	// alarm keeps it off
+	auto startHeater() -> void {
+		if (heaterRecovery != HeaterRecovery::Monitoring) {
+			return;
+		}
+		tempController.setRun(true);
+	}
+
 	auto savePauseData(Timestamp now) -> void {
 		switch (state) {
 		case MainState::Idle: break;
@@ -260,7 +369,7 @@ struct MainImpl {
 		persistent.inner.pauseData = pauseData;
 		persistent.persist();
 
-		log("saved pause data: state = ", stateStr(pauseData->state),
+		log("saved pause data: state = ", mainStateStr(pauseData->state),
 			", elapsed = ", pauseData->elapsed.unsafeGetValue(), "ms");
 	}
 
@@ -308,7 +417,7 @@ struct MainImpl {
 		switch (state) {
 		case MainState::Idle:
 			for_each(chambers.begin(), chambers.end(),
-					 [](Chamber& ch) { ch.fan.write(false); });
+					 [](Chamber& ch) { ch.setFan(false); });
 			rotation.stop();
 			break;
 		case MainState::Preheating:
@@ -384,40 +493,63 @@ struct MainImpl {
 	}
 
 	auto detectHeaterFailure(Timestamp now) -> void {
-		// Track last transition of the heater output
-		auto const isOn = tempController.readOut1(now);
-		if (isOn.has_value()) {
-			if (*isOn && !isHeating) {
+		switch (heaterRecovery) {
+		case HeaterRecovery::Monitoring: break;
+		case HeaterRecovery::Off:
+			if ((now - heaterOffSince) >= recovery.offTime) {
+				log("heater recovery: starting the controller again");
+				heaterRecovery = HeaterRecovery::Monitoring;
+				tempController.setRun(true);
+				// Give it a full timeout before judging again
 				lastOutputTransition = now;
-				auto const temp = tempController.readPv(now);
-				if (temp) {
-					lastTransitionTemp = *temp;
-				}
+				isHeating = false;
 			}
+			return;
+		case HeaterRecovery::Alarm: return;
+		}
+
+		// Output and temperature come from the same controller snapshot
+		auto const snapshot = tempController.snapshot(now, HEATER_PV_MAX_AGE);
+		if (!snapshot) {
+			log.debug("failed to read temp");
+			return;
+		}
 
-			isHeating = *isOn;
+		// Track last transition of the heater output
+		if (snapshot->out1 && !isHeating) {
+			lastOutputTransition = now;
+			lastTransitionTemp = snapshot->pv;
 		}
+		isHeating = snapshot->out1;
 
 		// Actually detect the failure
 		auto const elapsed = now - lastOutputTransition;
 		auto const timePassed = elapsed > HEATER_FAILURE_TIMEOUT;
-		auto const currentTemp = tempController.readPv(now);
-		if (!currentTemp) {
-			log("failed to read temp");
-			return;
-		}
+		auto const currentTemp = snapshot->pv;
 
-		auto const tempDiff = *currentTemp - lastTransitionTemp;
+		auto const tempDiff = currentTemp - lastTransitionTemp;
 		auto const badTempDiff = tempDiff < HEATER_FAILURE_TEMP_DIFF;
 
+		if (isHeating && !badTempDiff) {
+			heaterRetries = 0;
+		}
+
 		if (isHeating && timePassed && badTempDiff) {
-			log("heater failure detected trying to get the controller to retry");
 			tempController.setRun(false);
-			delay(1000);
-			tempController.setRun(true);
+			lastTransitionTemp = currentTemp;
 
-			lastOutputTransition = now;
-			lastTransitionTemp = *currentTemp;
+			if (heaterRetries >= recovery.maxRetries) {
+				log("heater failure persists after ", heaterRetries,
+					" retries, alarm latched");
+				heaterRecovery = HeaterRecovery::Alarm;
+				return;
+			}
+
+			++heaterRetries;
+			log("heater failure detected trying to get the controller to retry",
+				" (", heaterRetries, "/", recovery.maxRetries, ")");
+			heaterRecovery = HeaterRecovery::Off;
+			heaterOffSince = now;
 		}
 	}
 
@@ -443,8 +575,8 @@ struct MainImpl {
 									  Timestamp now) -> void {
 		auto const temp = ch.sensor.getTemp(now);
 		if (!temp) {
-			log("failed to read temp");
-			ch.fan.write(false);
+			log.debug("failed to read temp");
+			ch.setFan(false);
 			return;
 		}
 
@@ -453,9 +585,9 @@ struct MainImpl {
 		auto const high = targetTemp;
 
 		if (isOn && temp > high) {
-			ch.fan.write(false);
+			ch.setFan(false);
 		} else if (!isOn && temp < low) {
-			ch.fan.write(true);
+			ch.setFan(true);
 		}
 	}
 
@@ -479,10 +611,16 @@ struct MainImpl {
 	double lastTransitionTemp = 0;
 	bool isHeating = false;
 
+	HeaterRecoveryConfig recovery;
+	HeaterRecovery heaterRecovery = HeaterRecovery::Monitoring;
+	Timestamp heaterOffSince = 0;
+	int heaterRetries = 0;
+
 	std::array<Chamber, 3>& chambers;
 	Rotation& rotation;
 	AutonicsTempController& tempController;
 	State& persistent;
+	UiEvents& events;
 };
 
 using Main = MainImpl<>;
@@ -1,15 +1,21 @@
 #pragma once
 
-#include "Main.h"
+#include "UiEvents.h"
 #include "kev/Edge.h"
+#include "kev/Log.h"
 #include "kev/Pin.h"
 #include "kev/Time.h"
 
 using kev::Edge;
 using kev::Input;
 using kev::EdgeDebounced;
+using kev::Log;
+using kev::Timestamp;
 using namespace kev::literals;
 
+// Well below the debounce times
+constexpr auto PHYSICAL_UI_POLL = 10_ms;
+
 struct PhysicalUiPinout {
 	Input& stopButton;
 	Input& rotationButton;
@@ -17,8 +23,8 @@ struct PhysicalUiPinout {
 
 template <typename = void>
 struct PhysicalUiImpl {
-	PhysicalUiImpl(Main& main, PhysicalUiPinout pinout)
-		: main{main},
+	PhysicalUiImpl(UiEvents& events, PhysicalUiPinout pinout)
+		: events{events},
 		  pinout{std::move(pinout)},
 		  stopButtonEdge{pinout.stopButton, 1_s},
 		  rotationButtonEdge{pinout.rotationButton} {}
@@ -28,21 +34,21 @@ struct PhysicalUiImpl {
 		rotationButtonEdge.update();
 
 		if (stopButtonEdge.risingEdge()) {
-			main.eventUiStart(now);
+			events.post(UiEventKind::Start, UiSource::Buttons, now);
 			log("starting because of button press");
 		}
 
 		if (rotationButtonEdge.risingEdge()) {
-			// main.eventUiRotateFw();
+			// events.post(UiEventKind::RotateFw, UiSource::Buttons, now);
 		}
 
 		if (rotationButtonEdge.fallingEdge()) {
-			// main.eventUiRotateFwStop();
+			// events.post(UiEventKind::RotateFwStop, UiSource::Buttons, now);
 		}
 	}
 
    private:
-	Main& main;
+	UiEvents& events;
 	PhysicalUiPinout pinout;
 	EdgeDebounced<Input> stopButtonEdge;
 	Edge<Input> rotationButtonEdge;
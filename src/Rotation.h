@@ -27,5 +27,5 @@ struct Rotation {
 	Output fw;
 	Output bw;
 
-	kev::Log<false> log{"rotation"};
+	kev::Log<kev::LogLevel::Off> log{"rotation"};
 };
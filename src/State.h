@@ -36,12 +36,9 @@ struct StateImpl {
 			inner = {};
 		}
 
-		log.partial_start();
-		log.partial("restored preferences: State{");
-		log.partial("\n  preheatTemp = ", inner.config.preheatTemp);
-		log.partial("\n  chamberTempHist = ", inner.config.chamberTempHist);
-		log.partial("\n}");
-		log.partial_end();
+		log("restored preferences: State{\n  preheatTemp = ",
+			inner.config.preheatTemp, "\n  chamberTempHist = ",
+			inner.config.chamberTempHist, "\n}");
 	}
 
    private:
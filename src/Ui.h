@@ -1,30 +1,51 @@
 #pragma once
 
 #include <cstdio>
+#include <cstring>
+#include <optional>
 #include <string_view>
 #include "ConfigCommon.h"
 #include "HardwareSerial.h"
-#include "RS485.h"
 #include "State.h"
-extern "C" {
-#include "libmodbus/modbus-rtu.h"
-#include "libmodbus/modbus.h"
-}
 
 #include "kev/Log.h"
+#include "kev/ModbusBus.h"
+#include "kev/ModbusShadow.h"
+#include "kev/Profiler.h"
 #include "kev/Timer.h"
 
-#include "Main.h"
+#include "ControlLink.h"
+#include "UiEvents.h"
 
+using kev::Duration;
 using kev::Log;
+using kev::LogLevel;
+using kev::ModbusBus;
+using kev::ModbusCompletion;
+using kev::ModbusPriority;
+using kev::ModbusSlave;
+using kev::ModbusTransaction;
 using kev::Timer;
 using kev::Timestamp;
+using std::array;
 using std::snprintf;
 using std::string_view;
 
 using namespace kev::literals;
 
-constexpr auto SCREEN_BAUDS = 38400;
+// The panel is slow to answer while it redraws, writes even more so
+constexpr auto SCREEN_TURNAROUND = 100_ms;
+
+// Resend the whole image now and then in case the screen rebooted
+constexpr auto SCREEN_RESYNC = 30_s;
+
+// Input is polled fast for a while after the user touches something and
+// slowly otherwise. The slow rate still has to catch a short tap.
+struct UiPollRates {
+	Duration fast = 10_ms;
+	Duration slow = 100_ms;
+	Duration fastWindow = 3_s;
+};
 
 constexpr auto SCREEN_STATUS = 0;
 constexpr auto SCREEN_CONFIG = 10;
@@ -34,8 +55,8 @@ enum class UiState {
 	Config,
 };
 
+// Lamps and buttons travel as the bits of one register, first field in bit 0
 struct Lamps {
-	// Starts at address 0 of flags
 	uint8_t heartbeat = false;
 	uint8_t heater = false;
 	uint8_t rotation = false;
@@ -43,7 +64,6 @@ struct Lamps {
 };
 
 struct Buttons {
-	// Starts at address 20 of flags
 	uint8_t rotate_fw = false;
 	uint8_t rotate_bw = false;
 	uint8_t pause = false;
@@ -81,7 +101,6 @@ struct UiStage {
 };
 
 struct UiConfig {
-	// Starts at address 20 of registers
 	uint16_t preheatTemp;
 	uint16_t tempHist;
 	array<UiStage, 3> stages;
@@ -101,28 +120,152 @@ static_assert(sizeof(UiConfig) == (2 * 2 + 2 * 3 * 3));
 using StrSend = array<uint16_t, 20>;
 
 struct UiStrings {
-	StrSend state;               // 100 - 120
-	array<StrSend, 3> fanTemps;  // 120 - 180
-	StrSend time;                // 180 - 200
-	StrSend heaterTemp;          // 200 - 220
+	StrSend state;
+	array<StrSend, 3> fanTemps;
+	StrSend time;
+	StrSend heaterTemp;
 };
 
-template <typename = void>
-struct UiImpl {
-	UiImpl(Main& main, State& persistent, int addr)
-		: main{main}, persistent{persistent}, addr{addr} {}
+static_assert(sizeof(Lamps) <= 16 && sizeof(Buttons) <= 16);
+static_assert(sizeof(UiStrings) == 6 * sizeof(StrSend));
+
+// The panel layout is chosen at build time and the kinco_screen project has
+// to match it. The project in the tree still has the original layout, so
+// that is the default. Only build with -DUI_BLOCK_LAYOUT=1 together with a
+// panel project rebound to UI_BLOCK_MAP.
+#ifndef UI_BLOCK_LAYOUT
+#define UI_BLOCK_LAYOUT 0
+#endif
+
+struct UiRegion {
+	char const* name;
+	uint16_t address;
+	uint16_t count;
+
+	constexpr auto end() const -> uint16_t { return address + count; }
+};
+
+constexpr auto uiRegion(char const* name, uint16_t address, size_t bytes)
+	-> UiRegion {
+	return {name, address, static_cast<uint16_t>((bytes + 1) / 2)};
+}
+
+// Everything else is holding registers. Lamps and buttons are either one
+// coil per field or the bits of one register each.
+struct UiRegisterMap {
+	bool flagCoils;
+	UiRegion screen;
+	UiRegion lamps;
+	UiRegion strings;
+	UiRegion buttons;
+	UiRegion config;
+};
+
+// The original layout, spread out so a refresh takes a frame per region
+constexpr auto UI_LEGACY_MAP = UiRegisterMap{
+	.flagCoils = true,
+	.screen = {"screen", 0, 1},
+	.lamps = {"lamps", 0, sizeof(Lamps)},
+	.strings = uiRegion("strings", 100, sizeof(UiStrings)),
+	.buttons = {"buttons", 20, sizeof(Buttons)},
+	.config = uiRegion("config", 20, sizeof(UiConfig)),
+};
 
-	auto begin() -> void {
-		mb = modbus_new_rtu(&RS485, SCREEN_BAUDS, SERIAL_8N1);
-		modbus_set_response_timeout(mb, 0, 100000);  // 100ms
-		modbus_set_byte_timeout(mb, 0, 10000);       // 10ms
-		modbus_connect(mb);
-		mb_perror();
+// Everything the firmware writes on a refresh sits in one block and
+// everything it reads in another, so a refresh is one frame each way
+constexpr auto UI_BLOCK_MAP = [] {
+	auto map = UiRegisterMap{};
+	map.screen = {"screen", 0, 1};
+	map.lamps = {"lamps", map.screen.end(), 1};
+	map.strings = uiRegion("strings", map.lamps.end(), sizeof(UiStrings));
+	map.buttons = {"buttons", 128, 1};
+	map.config = uiRegion("config", map.buttons.end(), sizeof(UiConfig));
+	return map;
+}();
+
+constexpr auto UI_WRITE_BLOCK =
+	UiRegion{"write", UI_BLOCK_MAP.screen.address, UI_BLOCK_MAP.strings.end()};
+constexpr auto UI_READ_BLOCK =
+	UiRegion{"read", UI_BLOCK_MAP.buttons.address,
+			 static_cast<uint16_t>(UI_BLOCK_MAP.config.end() -
+								   UI_BLOCK_MAP.buttons.address)};
+
+// Regions of the map follow each other without gaps inside a block
+constexpr auto uiBlockIsContiguous(UiRegisterMap const& map, UiRegion block)
+	-> bool {
+	auto next = block.address;
+	for (auto const& region :
+		 {map.screen, map.lamps, map.strings, map.buttons, map.config}) {
+		if (region.address >= block.address && region.address < block.end()) {
+			if (region.address != next) {
+				return false;
+			}
+			next = region.end();
+		}
+	}
+	return next == block.end();
+}
 
-		modbus_set_slave(mb, addr);
-		// modbus_set_debug(mb, true);
+static_assert(uiBlockIsContiguous(UI_BLOCK_MAP, UI_WRITE_BLOCK));
+static_assert(uiBlockIsContiguous(UI_BLOCK_MAP, UI_READ_BLOCK));
+static_assert(UI_WRITE_BLOCK.end() <= UI_READ_BLOCK.address);
+static_assert(UI_WRITE_BLOCK.count <= kev::MODBUS_MAX_REGISTERS);
+static_assert(UI_READ_BLOCK.count <= kev::MODBUS_MAX_REGISTERS);
+static_assert(UI_LEGACY_MAP.screen.end() <= UI_LEGACY_MAP.config.address &&
+			  UI_LEGACY_MAP.config.end() <= UI_LEGACY_MAP.strings.address);
+static_assert(UI_LEGACY_MAP.lamps.end() <= UI_LEGACY_MAP.buttons.address);
+static_assert(UI_BLOCK_MAP.config.count == 2 + 3 * 3);
+
+constexpr auto UI_MAP = UI_BLOCK_LAYOUT ? UI_BLOCK_MAP : UI_LEGACY_MAP;
+constexpr auto UI_SCREEN = UI_MAP.screen;
+constexpr auto UI_LAMPS = UI_MAP.lamps;
+constexpr auto UI_STRINGS = UI_MAP.strings;
+constexpr auto UI_BUTTONS = UI_MAP.buttons;
+constexpr auto UI_CONFIG = UI_MAP.config;
+
+// Address space mirrored by the shadow image, up to the end of the strings
+constexpr auto SCREEN_REGISTERS = UI_STRINGS.end();
+
+// Flag structs to and from one register
+template <class Flags>
+auto packFlags(Flags const& flags) -> uint16_t {
+	auto bytes = array<uint8_t, sizeof(Flags)>{};
+	std::memcpy(bytes.data(), &flags, sizeof(flags));
+	auto word = uint16_t{0};
+	for (auto i = 0u; i < bytes.size(); ++i) {
+		word |= static_cast<uint16_t>((bytes[i] != 0) << i);
+	}
+	return word;
+}
+
+template <class Flags>
+auto unpackFlags(uint16_t word) -> Flags {
+	auto bytes = array<uint8_t, sizeof(Flags)>{};
+	for (auto i = 0u; i < bytes.size(); ++i) {
+		bytes[i] = (word >> i) & 1;
+	}
+	auto flags = Flags{};
+	std::memcpy(&flags, bytes.data(), sizeof(flags));
+	return flags;
+}
 
-		sendGotoScreen(SCREEN_STATUS);
+template <typename = void>
+struct UiImpl {
+	UiImpl(ControlLink& link,
+		   UiEvents& events,
+		   ModbusBus& bus,
+		   uint8_t addr,
+		   UiPollRates rates = {})
+		: rates{rates},
+		  link{link},
+		  events{events},
+		  mb{bus, addr, SCREEN_TURNAROUND, ModbusPriority::Input} {}
+
+	auto begin() -> void { sendGotoScreen(SCREEN_STATUS); }
+
+	// When tick() has something to do next
+	auto nextDeadline() const -> Timestamp {
+		return kev::earliest(stateUpdate.deadline(), inputUpdate.deadline());
 	}
 
 	auto tick(Timestamp now) -> void {
@@ -130,42 +273,116 @@ struct UiImpl {
 
 		if (inputUpdate.isDone(now)) {
 			inputUpdate.reset(now);
+			auto const active = (now - lastActivity) < rates.fastWindow;
+			inputUpdate.setPeriod(active ? rates.fast : rates.slow);
 
-			auto start2 = millis();
+			KEV_PROFILE_SCOPE("ui.input");
 			processInput(now);
-			auto end2 = millis();
-			avgInput = avgInput * 0.9 + (end2 - start2) * 0.1;
 		}
-		auto end = Timestamp{millis()};
 	}
 
    private:
 	auto processCurrentState(Timestamp now) -> void {
+		// The panel forgets everything when it reboots, so once it answers
+		// again it gets the whole screen without waiting for the resync
+		auto const reachable = mb.isReachable();
+		if (resyncTimer.isDone(now) || (reachable && !wasReachable)) {
+			resyncTimer.reset(now);
+			shadow.invalidate();
+			lampCoilsSent.reset();
+		}
+		wasReachable = reachable;
+
 		if (stateUpdate.isDone(now)) {
-			auto start1 = millis();
-			updateScreen(now);
-			auto end1 = millis();
-			avgCurrState = avgCurrState * 0.9 + (end1 - start1) * 0.1;
+			{
+				KEV_PROFILE_SCOPE("ui.state");
+				updateScreen(now);
+			}
 			stateUpdate.reset(millis());
 		}
 	}
 
-	auto processInput(Timestamp now) -> void {
+	// Queue the input read, handled in onInput. The config only matters on
+	// its screen, elsewhere the buttons at the start of the block are enough.
+	auto processInput(Timestamp) -> void {
+		if constexpr (UI_MAP.flagCoils) {
+			processLegacyInput();
+			return;
+		}
+		if (inputPending) {
+			return;
+		}
+		auto const count = state == UiState::Config ? UI_READ_BLOCK.count
+													: UI_BUTTONS.count;
+		inputPending =
+			mb.readRegisters(UI_READ_BLOCK.address, count,
+							 ModbusCompletion::bind<&UiImpl::onInput>(this));
+	}
+
+	// Buttons and config sit apart there, a read each
+	auto processLegacyInput() -> void {
+		if (!inputPending) {
+			inputPending = mb.readBits(
+				UI_BUTTONS.address, UI_BUTTONS.count,
+				ModbusCompletion::bind<&UiImpl::onButtonCoils>(this));
+		}
+		if (state == UiState::Config && !configPending) {
+			configPending = mb.readRegisters(
+				UI_CONFIG.address, UI_CONFIG.count,
+				ModbusCompletion::bind<&UiImpl::onConfigRegisters>(this));
+		}
+	}
+
+	auto onButtonCoils(ModbusTransaction const& tx, Timestamp now) -> void {
+		inputPending = false;
+		if (!tx.ok()) {
+			return;
+		}
 		auto buttons = Buttons{};
-		delay(1);
-		modbus_read_bits(mb, 20, sizeof(buttons),
-						 reinterpret_cast<uint8_t*>(&buttons));
+		std::memcpy(&buttons, tx.bits.data(), sizeof(buttons));
+		onButtons(buttons, now);
+	}
+
+	auto onConfigRegisters(ModbusTransaction const& tx, Timestamp now)
+		-> void {
+		configPending = false;
+		if (!tx.ok()) {
+			return;
+		}
+		auto uiConfig = UiConfig{};
+		std::memcpy(&uiConfig, tx.regs.data(), sizeof(uiConfig));
+		onUiConfig(uiConfig, now);
+	}
+
+	auto onInput(ModbusTransaction const& tx, Timestamp now) -> void {
+		inputPending = false;
+		if (!tx.ok()) {
+			// Keep the previous state, a failed read is not a release
+			return;
+		}
+
+		onButtons(unpackFlags<Buttons>(tx.regs[0]), now);
+		if (tx.count >= UI_READ_BLOCK.count) {
+			auto uiConfig = UiConfig{};
+			std::memcpy(&uiConfig,
+						tx.regs.data() + (UI_CONFIG.address - tx.address),
+						sizeof(uiConfig));
+			onUiConfig(uiConfig, now);
+		}
+	}
+
+	auto onButtons(Buttons const& buttons, Timestamp now) -> void {
 
 		if (buttons.preheat && !prevButtons.preheat) {
-			main.eventUiPreheat(now);
+			events.post(UiEventKind::Preheat, UiSource::Panel, now);
 		}
 
 		if (buttons.stop && !prevButtons.stop) {
-			main.eventUiStop(now);
+			events.post(UiEventKind::Stop, UiSource::Panel, now);
 		}
 
 		if (buttons.start && !prevButtons.start) {
-			main.eventUiStart(now);
+			events.post(UiEventKind::Start, UiSource::Panel, now);
 		}
 
 		if (buttons.config && !prevButtons.config) {
@@ -175,23 +392,23 @@ struct UiImpl {
 		}
 
 		if (buttons.rotate_fw && !prevButtons.rotate_fw) {
-			main.eventUiRotateFw();
+			events.post(UiEventKind::RotateFw, UiSource::Panel, now);
 		}
 
 		if (buttons.rotate_bw && !prevButtons.rotate_bw) {
-			main.eventUiRotateBw();
+			events.post(UiEventKind::RotateBw, UiSource::Panel, now);
 		}
 
 		if (!buttons.rotate_fw && prevButtons.rotate_fw) {
-			main.eventUiRotateFwStop();
+			events.post(UiEventKind::RotateFwStop, UiSource::Panel, now);
 		}
 
 		if (!buttons.rotate_bw && prevButtons.rotate_bw) {
-			main.eventUiRotateBwStop();
+			events.post(UiEventKind::RotateBwStop, UiSource::Panel, now);
 		}
 
 		if (buttons.pause && !prevButtons.pause) {
-			main.eventUiPause(now);
+			events.post(UiEventKind::Pause, UiSource::Panel, now);
 		}
 
 		if (buttons.config_back && !prevButtons.config_back) {
@@ -201,48 +418,52 @@ struct UiImpl {
 		}
 
 		if (buttons != prevButtons) {
+			lastActivity = now;
 			updateScreen(now);
 		}
 
-		if (state == UiState::Config) {
-			auto uiConfig = UiConfig{};
-			delay(1);
-			modbus_read_registers(mb, 20, sizeof(uiConfig) / sizeof(uint16_t),
-								  reinterpret_cast<uint16_t*>(&uiConfig));
-
-			if (uiConfig != prevUiConfig && uiConfig.preheatTemp != 0) {
-				log("using new config from UI");
-				auto config = configFromUiConfig(uiConfig);
-				main.setConfig(config);
+		prevButtons = buttons;
+	}
 
-				persistent.inner.config = config;
-				persistent.persist();
-			}
-			prevUiConfig = uiConfig;
+	auto onUiConfig(UiConfig const& uiConfig, Timestamp now) -> void {
+		if (state != UiState::Config) {
+			return;
 		}
 
-		prevButtons = buttons;
+		if (uiConfig != prevUiConfig && uiConfig.preheatTemp != 0) {
+			lastActivity = now;
+			log("using new config from UI");
+			// Applied and persisted on the control task
+			link.post({.kind = MainCommandKind::SetConfig,
+					   .config = configFromUiConfig(uiConfig)});
+		}
+		prevUiConfig = uiConfig;
 	}
 
-	auto updateScreen(Timestamp now) -> void {
-		delay(1);
-
-		heartbeat = !heartbeat;
-		auto s1 = millis();
-		sendLamps(Lamps{
-			.heartbeat = heartbeat,
-			.heater = main.readHeater(now),
-			.rotation = main.readRotation(),
-			.fans = {main.readFan(0), main.readFan(1), main.readFan(2)},
-		});
-		avgSendLamps = avgSendLamps * 0.7 + (millis() - s1) * 0.3;
+	auto updateScreen(Timestamp) -> void {
+		auto const st = link.read();
+		// The panel project has no lamp of its own for the overrun alarm,
+		// the heartbeat shows it by staying lit three beats out of four
+		++beats;
+		auto const heartbeat =
+			st.overrunAlarm ? beats % 4 != 0 : beats % 2 != 0;
+		{
+			KEV_PROFILE_SCOPE("ui.lamps");
+			sendLamps(Lamps{
+				.heartbeat = heartbeat,
+				.heater = st.heater,
+				.rotation = st.rotation,
+				.fans = {st.chambers[0].fan, st.chambers[1].fan,
+						 st.chambers[2].fan},
+			});
+		}
 
 		auto payload = UiStrings{};
-		setString(payload.state, main.displayState());
+		setString(payload.state, mainStateDisplay(st.state));
 
 		for (auto i = 0; i < 3; ++i) {
 			auto temp = array<char, 20>{};
-			auto tempVal = main.readTemp(i, now);
+			auto const& tempVal = st.chambers[i].temp;
 			if (!tempVal) {
 				setString(payload.fanTemps[i], "Error de sensor");
 				continue;
@@ -252,9 +473,7 @@ struct UiImpl {
 		}
 
 		auto temp = array<char, 20>{};
-		auto s2 = millis();
-		auto tempVal = main.heaterTemp(now);
-		avgReqPv = avgReqPv * 0.7 + (millis() - s2) * 0.3;
+		auto const& tempVal = st.heaterTemp;
 		if (!tempVal) {
 			setString(payload.heaterTemp, "Error de sensor");
 		} else {
@@ -262,7 +481,7 @@ struct UiImpl {
 			setString(payload.heaterTemp, temp.data());
 		}
 
-		auto const timer = main.readCurrentTimer(now);
+		auto const& timer = st.timer;
 		if (timer) {
 			auto time = array<char, 20>{};
 			snprintf(time.data(), time.size(), "%02d:%02d:%02d",
@@ -274,11 +493,10 @@ struct UiImpl {
 			setString(payload.time, "N/A");
 		}
 
-		auto s3 = millis();
-		modbus_write_registers(mb, 100, sizeof(UiStrings) / sizeof(uint16_t),
-							   reinterpret_cast<uint16_t*>(&payload));
-		avgSendStrings = avgSendStrings * 0.7 + (millis() - s3) * 0.3;
-		mb_perror();
+		KEV_PROFILE_SCOPE("ui.strings");
+		shadow.writeRegisters(UI_STRINGS.address, UI_STRINGS.count,
+							  reinterpret_cast<uint16_t*>(&payload));
+		shadow.flush(mb.with(ModbusPriority::Cosmetic));
 	}
 
 	auto setString(StrSend& target, std::string_view str) -> void {
@@ -293,33 +511,41 @@ struct UiImpl {
 	}
 
 	auto sendLamps(Lamps lamps) {
-		modbus_write_bits(mb, 0, sizeof(lamps),
-						  reinterpret_cast<uint8_t*>(&lamps));
-		mb_perror();
+		auto const word = packFlags(lamps);
+		if constexpr (!UI_MAP.flagCoils) {
+			shadow.writeRegisters(UI_LAMPS.address, UI_LAMPS.count, &word);
+			return;
+		}
+		// Coils aren't in the shadow, only what changed goes out
+		if (lampCoilsSent == word) {
+			return;
+		}
+		auto const done =
+			ModbusCompletion::bind<&UiImpl::onLampCoilsWritten>(this);
+		if (mb.with(ModbusPriority::Cosmetic)
+				.writeBits(UI_LAMPS.address, UI_LAMPS.count,
+						   reinterpret_cast<uint8_t*>(&lamps), done)) {
+			lampCoilsSent = word;
+		}
 	}
 
-	auto mb_perror() -> bool {
-		if (errno != 0) {
-			log("modbus error: ", modbus_strerror(errno));
-			errno = 0;
-			return true;
+	auto onLampCoilsWritten(ModbusTransaction const& tx, Timestamp) -> void {
+		if (!tx.ok()) {
+			lampCoilsSent.reset();  // Again on the next refresh
 		}
-		return false;
 	}
 
+	// Right away, without waiting for the next refresh
 	auto sendGotoScreen(int screen) -> void {
 		auto const screen_reg = static_cast<uint16_t>(screen);
-		delay(1);
-		modbus_write_registers(mb, 0, 1, &screen_reg);
-		mb_perror();
+		shadow.writeRegisters(UI_SCREEN.address, UI_SCREEN.count, &screen_reg);
+		shadow.flush(mb);
 	}
 
 	auto sendConfigScreen() -> void {
-		auto uiConfig = uiConfigFromConfig(main.getConfig());
-		delay(1);
-		modbus_write_registers(mb, 20, sizeof(uiConfig) / sizeof(uint16_t),
-							   reinterpret_cast<uint16_t*>(&uiConfig));
-		mb_perror();
+		auto uiConfig = uiConfigFromConfig(link.readDetails().config);
+		mb.writeRegisters(UI_CONFIG.address, UI_CONFIG.count,
+						  reinterpret_cast<uint16_t*>(&uiConfig));
 	}
 
 	auto configFromUiConfig(UiConfig const& uiConfig) -> Config {
@@ -372,24 +598,25 @@ struct UiImpl {
 	}
 
 	UiState state = UiState::Status;
-	bool heartbeat = false;
+	unsigned beats = 0;
 	Buttons prevButtons = {};
 	UiConfig prevUiConfig = {};
 	Timer stateUpdate{1000_ms};
-	Timer inputUpdate{10_ms};
-
-	Log<false> log{"ui"};
-	modbus_t* mb;
-	Main& main;
-	State& persistent;
-	int addr = 0;
-
-   public:
-	double avgCurrState = 0.0;
-	double avgInput = 0.0;
-	double avgSendLamps = 0.0;
-	double avgSendStrings = 0.0;
-	double avgReqPv = 0.0;
+	UiPollRates rates;
+	Timer inputUpdate{rates.fast};
+	Timestamp lastActivity = {};
+	Timer resyncTimer{SCREEN_RESYNC};
+	bool inputPending = false;
+	bool configPending = false;
+	bool wasReachable = true;
+	// Last lamp word written as coils, none when it has to go out again
+	std::optional<uint16_t> lampCoilsSent = {};
+
+	Log<LogLevel::Off> log{"ui"};
+	ControlLink& link;
+	UiEvents& events;
+	ModbusSlave mb;
+	kev::ModbusShadow<SCREEN_REGISTERS> shadow;
 };
 
 using Ui = UiImpl<>;
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <optional>
+
+#include "kev/Log.h"
+#include "kev/Mpsc.h"
+#include "kev/Time.h"
+
+// Button presses and the like from every front-end, in the order they were
+// posted. MainImpl takes them out at the start of its tick, so whatever the
+// panel, the buttons, serial and web do lands at one defined point.
+
+constexpr auto UI_EVENT_QUEUE = 16;
+
+enum class UiEventKind {
+	Preheat,
+	Start,
+	Stop,
+	Pause,
+	RotateFw,
+	RotateFwStop,
+	RotateBw,
+	RotateBwStop,
+};
+
+enum class UiSource {
+	Panel,
+	Buttons,
+	Serial,
+	Web,
+
+	Max,
+};
+
+constexpr auto UI_SOURCES = static_cast<size_t>(UiSource::Max);
+
+struct UiEvent {
+	UiEventKind kind = UiEventKind::Stop;
+	UiSource source = UiSource::Panel;
+	kev::Timestamp at = {};  // When the front-end saw it
+};
+
+inline auto uiEventKindStr(UiEventKind kind) -> char const* {
+	switch (kind) {
+	case UiEventKind::Preheat: return "preheat";
+	case UiEventKind::Start: return "start";
+	case UiEventKind::Stop: return "stop";
+	case UiEventKind::Pause: return "pause";
+	case UiEventKind::RotateFw: return "rotate fw";
+	case UiEventKind::RotateFwStop: return "rotate fw stop";
+	case UiEventKind::RotateBw: return "rotate bw";
+	case UiEventKind::RotateBwStop: return "rotate bw stop";
+	}
+	return "unknown";
+}
+
+inline auto uiSourceStr(UiSource source) -> char const* {
+	switch (source) {
+	case UiSource::Panel: return "panel";
+	case UiSource::Buttons: return "buttons";
+	case UiSource::Serial: return "serial";
+	case UiSource::Web: return "web";
+	default: return "unknown";
+	}
+}
+
+template <typename = void>
+struct UiEventsImpl {
+	// Any task
+	auto post(UiEventKind kind, UiSource source, kev::Timestamp at) -> bool {
+		auto& counts = sources[static_cast<size_t>(source)];
+		if (!queue.push({kind, source, at})) {
+			counts.dropped.fetch_add(1, std::memory_order_relaxed);
+			log.warn("queue full, dropped ", uiEventKindStr(kind), " from ",
+					 uiSourceStr(source));
+			return false;
+		}
+		counts.posted.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// MainImpl only. Counts the event as handled at `now`.
+	auto next(kev::Timestamp now) -> std::optional<UiEvent> {
+		auto const event = queue.pop();
+		if (!event) {
+			return {};
+		}
+		// Posted from the other task after the tick read the clock, it
+		// was seen in time
+		auto const latency = std::max((now - event->at).unsafeGetValue(), 0l);
+		handled.fetch_add(1, std::memory_order_relaxed);
+		totalLatency.fetch_add(latency, std::memory_order_relaxed);
+		if (latency > maxLatency.load(std::memory_order_relaxed)) {
+			maxLatency.store(latency, std::memory_order_relaxed);
+		}
+		return event;
+	}
+
+	auto depth() const -> unsigned { return queue.depth(); }
+	auto maxDepth() const -> unsigned { return queue.maxDepthSeen(); }
+	auto posted(UiSource source) const -> unsigned long {
+		return sources[static_cast<size_t>(source)].posted.load();
+	}
+	auto dropped(UiSource source) const -> unsigned long {
+		return sources[static_cast<size_t>(source)].dropped.load();
+	}
+	auto handledCount() const -> unsigned long { return handled.load(); }
+	// From the front-end seeing it to MainImpl acting on it, in ms
+	auto latencyAvg() const -> long {
+		auto const n = handled.load();
+		return n ? totalLatency.load() / static_cast<long>(n) : 0;
+	}
+	auto latencyMax() const -> long { return maxLatency.load(); }
+
+   private:
+	struct SourceCounts {
+		std::atomic<unsigned long> posted{0};
+		std::atomic<unsigned long> dropped{0};
+	};
+
+	kev::MpscQueue<UiEvent, UI_EVENT_QUEUE> queue;
+	std::array<SourceCounts, UI_SOURCES> sources{};
+	std::atomic<unsigned long> handled{0};
+	std::atomic<long> totalLatency{0};
+	std::atomic<long> maxLatency{0};
+	kev::Log<> log{"events"};
+};
+
+using UiEvents = UiEventsImpl<>;
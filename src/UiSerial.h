@@ -2,13 +2,24 @@
 
 #include <string_view>
 
+#include "ControlLink.h"
 #include "HardwareSerial.h"
-#include "Main.h"
+#include "UiEvents.h"
+#include "kev/AutonicsTempController.h"
 #include "kev/Log.h"
+#include "kev/ModbusBus.h"
+#include "kev/Scheduler.h"
+#include "kev/Profiler.h"
 #include "kev/String.h"
+#include "kev/TickMonitor.h"
 #include "kev/Time.h"
 #include "kev/Timer.h"
 
+using kev::AutonicsTempController;
+using kev::ModbusBus;
+using kev::ModbusPriority;
+using kev::Scheduler;
+using kev::TickMonitor;
 using kev::Timer;
 using kev::Timestamp;
 using std::array;
@@ -16,11 +27,22 @@ using std::string_view;
 using std::vector;
 
 using namespace kev::literals;
-using chambers_t = array<Chamber, 3>;
 
 struct UiSerial {
-	UiSerial(HardwareSerial& serial, Main& main, chambers_t& chambers)
-		: serial{serial}, main{main}, chambers{chambers} {}
+	UiSerial(HardwareSerial& serial,
+			 ControlLink& link,
+			 UiEvents& events,
+			 ModbusBus& bus,
+			 AutonicsTempController& tempController,
+			 array<Scheduler*, 2> schedulers,
+			 TickMonitor& controlTick)
+		: serial{serial},
+		  link{link},
+		  events{events},
+		  bus{bus},
+		  tempController{tempController},
+		  schedulers{schedulers},
+		  controlTick{controlTick} {}
 
 	auto begin() -> void { log("serial ui started"); }
 
@@ -30,8 +52,9 @@ struct UiSerial {
 	}
 
    private:
+	// Everything that came in since the last tick
 	auto checkForCommand(Timestamp now) -> void {
-		if (serial.available() > 0) {
+		while (serial.available() > 0) {
 			auto ch = static_cast<char>(serial.read());
 
 			if (ch == '\n' || ch == '\r') {
@@ -75,12 +98,26 @@ struct UiSerial {
 			stateCommand(tokens, now);
 		} else if (command == "ui") {
 			uiCommand(tokens, now);
+		} else if (command == "bus") {
+			busCommand(tokens, now);
+		} else if (command == "autonics") {
+			showAutonics(now);
+		} else if (command == "sensors") {
+			showSensors(now);
+		} else if (command == "log") {
+			showLog();
+		} else if (command == "events") {
+			showEvents();
+		} else if (command == "sched") {
+			schedCommand(tokens);
+		} else if (command == "tick") {
+			tickCommand(tokens);
+		} else if (command == "prof") {
+			profCommand();
 		} else if (command == "force" || command == "f") {
 			forceCommand(tokens);
 		} else if (command == "unforce") {
-			for (auto& ch : chambers) {
-				ch.sensor.unforceTemp();
-			}
+			link.post({MainCommandKind::UnforceTemps});
 		} else {
 			log("unknown command: ", command);
 		}
@@ -104,23 +141,29 @@ struct UiSerial {
 		}
 	}
 
-	auto showState(Timestamp now) -> void {
-		serial.printf("state: %s\n", main.readStateStr());
-		serial.printf("heater: %s\n", main.readHeater(now) ? "on" : "off");
-		serial.printf("rotation: %s (%s)\n", main.readRotation() ? "on" : "off",
-					  main.readRotationDir() ? "bw" : "fw");
+	auto showState(Timestamp) -> void {
+		auto const st = link.read();
+		serial.printf("state: %s (v%lu)\n", mainStateStr(st.state),
+					  st.version);
+		serial.printf("heater: %s%s\n", st.heater ? "on" : "off",
+					  st.heaterAlarm ? " - ALARM" : "");
+		if (st.overrunAlarm) {
+			serial.printf("control: OVERRUN\n");
+		}
+		serial.printf("rotation: %s (%s)\n", st.rotation ? "on" : "off",
+					  st.rotationBw ? "bw" : "fw");
 		for (int i = 0; i < 3; ++i) {
-			auto const temp = main.readTemp(i, now);
-			if (!temp) {
+			auto const& ch = st.chambers[i];
+			if (!ch.temp) {
 				serial.printf("chamber %d: fan %s - temp ERROR\n", i + 1,
-							  main.readFan(i) ? "on" : "off");
+							  ch.fan ? "on" : "off");
 				continue;
 			}
 			serial.printf("chamber %d: fan %s - temp %.1f °C\n", i + 1,
-						  main.readFan(i) ? "on" : "off", *temp);
+						  ch.fan ? "on" : "off", *ch.temp);
 		}
 
-		auto c = main.getConfig();
+		auto const c = link.readDetails().config;
 		serial.printf("Config\n");
 		serial.printf("  preheat temp: %.1f °C\n", c.preheatTemp);
 		serial.printf("  chamber temp histeresis: %.1f °C\n",
@@ -153,6 +196,222 @@ struct UiSerial {
 		}
 	}
 
+	auto busCommand(vector<string_view> const& tokens, Timestamp now)
+		-> void {
+		if (tokens.size() == 1 || tokens[1] == "classes") {
+			showBusClasses(now);
+			return;
+		}
+
+		auto const subcommand = tokens[1];
+
+		if (subcommand == "stats") {
+			showBusStats(now);
+		} else if (subcommand == "breakers") {
+			showBusBreakers(now);
+		} else if (subcommand == "reset") {
+			bus.resetStats(now);
+			serial.println("bus: stats reset");
+		} else {
+			log("bus: unknown subcommand: ", subcommand);
+		}
+	}
+
+	auto showBusClasses(Timestamp now) -> void {
+		serial.printf("bus: %u queued - %lu bytes/s\n",
+					  static_cast<unsigned>(bus.pending()),
+					  bus.bytesPerSecond(now));
+		auto const elapsedMs = bus.statsElapsed(now).unsafeGetValue();
+		for (auto i = 0u; i < kev::MODBUS_PRIORITIES; ++i) {
+			auto const priority = static_cast<ModbusPriority>(i);
+			auto const& st = bus.classStats(priority);
+			auto const n = st.transactions ? st.transactions : 1;
+			serial.printf(
+				"  %s: %lu tx - wait avg %ldms max %ldms - latency avg %ldms "
+				"max %ldms - deadline %ldms missed %lu - dropped %lu - "
+				"bytes tx %lu rx %lu - busy %lums (%.1f%%)\n",
+				kev::modbusPriorityStr(priority), st.transactions,
+				st.totalWait.unsafeGetValue() / n,
+				st.maxWait.unsafeGetValue(),
+				st.totalLatency.unsafeGetValue() / n,
+				st.maxLatency.unsafeGetValue(),
+				kev::MODBUS_DEADLINES[i].unsafeGetValue(), st.deadlineMisses,
+				st.dropped, st.txBytes, st.rxBytes,
+				static_cast<unsigned long>(st.busyUs / 1000),
+				elapsedMs > 0 ? st.busyUs / 10.0 / elapsedMs : 0.0);
+		}
+	}
+
+	auto showBusStats(Timestamp now) -> void {
+		auto const& t = bus.getTiming();
+		serial.printf(
+			"bus: %lu baud - char %luus - t1.5 %luus - t3.5 %luus\n",
+			bus.getBaud(), t.charUs, t.gapUs, t.silenceUs);
+		serial.printf("bus: %.1f%% busy over the last %ds - %lds of stats\n",
+					  bus.utilization(now), kev::MODBUS_UTILIZATION_WINDOW,
+					  bus.statsElapsed(now).unsafeGetValue() / 1000);
+		for (auto i = size_t{0}; i < bus.tagCount(); ++i) {
+			auto const& tag = bus.tagStats()[i];
+			auto const& h = tag.latency;
+			serial.printf(
+				"  slave %u fn 0x%02x: %lu tx - timeouts %lu - crc %lu - "
+				"other %lu - bytes tx %lu rx %lu - rtt p50 %.1fms p99 %.1fms "
+				"max %.1fms\n",
+				tag.slave, static_cast<unsigned>(tag.function),
+				tag.transactions, tag.timeouts, tag.crcErrors,
+				tag.otherErrors, tag.txBytes, tag.rxBytes,
+				h.percentileUs(50) / 1000.0, h.percentileUs(99) / 1000.0,
+				h.maxUs / 1000.0);
+		}
+		if (bus.untagged()) {
+			serial.printf("  %lu transactions over the tag limit\n",
+						  bus.untagged());
+		}
+	}
+
+	auto showBusBreakers(Timestamp now) -> void {
+		for (auto i = size_t{0}; i < bus.breakerCount(); ++i) {
+			auto const& b = bus.breakerStats()[i];
+			serial.printf(
+				"slave %u: %s - %u timeouts in a row - backoff %ldms",
+				b.slave, kev::modbusBreakerStateStr(b.state), b.failures,
+				b.backoff.unsafeGetValue());
+			if (b.state == kev::ModbusBreakerState::Open) {
+				serial.printf(" - probe in %ldms",
+							  (b.probeAt - now).unsafeGetValue());
+			}
+			serial.printf(
+				" - opened %lu - half-opened %lu - closed %lu - "
+				"short-circuited %lu\n",
+				b.opened, b.halfOpened, b.closed, b.shortCircuited);
+		}
+	}
+
+	auto showAutonics(Timestamp now) -> void {
+		auto const snapshot = tempController.snapshot(now);
+		if (snapshot) {
+			serial.printf(
+				"autonics: pv %d - out1 %s - sv %d - %s (%ldms old)\n",
+				snapshot->pv, snapshot->out1 ? "on" : "off", snapshot->sv,
+				snapshot->running ? "running" : "stopped",
+				(now - snapshot->at).unsafeGetValue());
+		} else {
+			serial.printf("autonics: no recent snapshot\n");
+		}
+
+		auto const& st = tempController.writeStats();
+		serial.printf(
+			"  writes %lu - suppressed %lu - restored %lu - retried %lu\n",
+			st.writes, st.suppressed, st.outOfBand, st.retries);
+	}
+
+	auto showSensors(Timestamp now) -> void {
+		auto const status = link.read();
+		auto const details = link.readDetails();
+		for (auto i = 0; i < 3; ++i) {
+			auto const& ch = status.chambers[i];
+			auto const& st = details.chambers[i].sensor;
+			serial.printf(
+				"sensor %d: %.2f%s - %lu samples - %lu errors - %lu rejected "
+				"- last %ldms ago - max interval %ldms - fan toggles %lu\n",
+				i + 1, ch.temp ? *ch.temp : 0.0,
+				ch.forced ? " (forced)" : (ch.temp ? "" : " (none)"),
+				st.samples, st.errors, st.rejected,
+				st.samples ? (now - st.lastSample).unsafeGetValue() : -1l,
+				st.maxInterval.unsafeGetValue(),
+				details.chambers[i].fanToggles);
+		}
+	}
+
+	auto showLog() -> void {
+		auto const st = kev::logRing.stats();
+		serial.printf(
+			"log: %lu written - %lu dropped - %lu truncated - depth %u max "
+			"%u of %u\n",
+			st.written, st.dropped, st.truncated, kev::logRing.depth(),
+			st.maxDepth, kev::LOG_RING_SIZE);
+	}
+
+	auto showEvents() -> void {
+		serial.printf(
+			"events: depth %u max %u of %u - %lu handled - latency avg %ldms "
+			"max %ldms\n",
+			events.depth(), events.maxDepth(), UI_EVENT_QUEUE,
+			events.handledCount(), events.latencyAvg(), events.latencyMax());
+		for (auto i = size_t{0}; i < UI_SOURCES; ++i) {
+			auto const source = static_cast<UiSource>(i);
+			serial.printf("  %s: %lu posted - %lu dropped\n",
+						  uiSourceStr(source), events.posted(source),
+						  events.dropped(source));
+		}
+	}
+
+	auto schedCommand(vector<string_view> const& tokens) -> void {
+		auto const reset = tokens.size() > 1 && tokens[1] == "reset";
+		for (auto* sched : schedulers) {
+			serial.printf("%s: idle %.1f%% - %u wakeups/s - %lu total\n",
+						  sched->getName(), sched->idlePercent(),
+						  sched->wakeupRate(), sched->totalWakeups());
+			for (auto i = size_t{0}; i < sched->jobCount(); ++i) {
+				auto const& job = sched->jobStats()[i];
+				serial.printf(
+					"  %s: %lu runs - late max %ldms - run max %luus\n",
+					job.name, job.runs.load(), job.maxLate.load(),
+					job.maxRunUs.load());
+			}
+			if (reset) {
+				sched->resetStats();
+			}
+		}
+	}
+
+	auto tickCommand(vector<string_view> const& tokens) -> void {
+		auto const& t = controlTick;
+		serial.printf(
+			"control tick %ldms, budget %ldms: %lu ticks - %lu overruns - "
+			"%lu skipped - alarm %s\n",
+			t.getPeriod().unsafeGetValue(), t.getBudget().unsafeGetValue(),
+			t.tickCount(), t.overrunCount(), t.skippedCount(),
+			t.inAlarm() ? "ON" : "off");
+		auto const show = [&](char const* what, kev::HistogramSummary h) {
+			serial.printf(
+				"  %s us: min %ld - mean %ld - p50 %ld - p99 %ld - max %ld\n",
+				what, h.min, h.mean, h.p50, h.p99, h.max);
+		};
+		show("late", t.latenessStats());
+		show("work", t.workStats());
+		for (auto const& b : t.blames()) {
+			if (auto const name = b.name.load(); name && b.count.load()) {
+				serial.printf("  overrun by %s: %lu\n", name, b.count.load());
+			}
+		}
+		if (tokens.size() > 1 && tokens[1] == "reset") {
+			controlTick.resetStats();
+		}
+	}
+
+	// Dumps every probe site and starts them over
+	auto profCommand() -> void {
+		if (!KEV_PROFILE) {
+			serial.printf("profiling compiled out (KEV_PROFILE=0)\n");
+			return;
+		}
+		serial.printf("%-14s %8s %8s %8s %8s %8s %8s\n", "site (us)", "count",
+					  "min", "mean", "p50", "p99", "max");
+		kev::profRegistry.forEach(
+			[&](kev::ProfSite const& site) {
+				auto const h = site.hist.summary();
+				serial.printf("%-14s %8lu %8ld %8ld %8ld %8ld %8ld\n",
+							  site.name, h.count, h.min, h.mean, h.p50, h.p99,
+							  h.max);
+			},
+			true);
+		if (kev::profRegistry.overflowed()) {
+			serial.printf("more than %u sites, the rest aren't shown\n",
+						  static_cast<unsigned>(kev::PROFILER_MAX_SITES));
+		}
+	}
+
 	// Simulate event from physical UI
 	auto uiCommand(vector<string_view> const& tokens, Timestamp now) -> void {
 		if (tokens.size() == 1) {
@@ -162,21 +421,21 @@ struct UiSerial {
 
 		auto const event = tokens[1];
 		if (event == "preheat") {
-			main.eventUiPreheat(now);
+			events.post(UiEventKind::Preheat, UiSource::Serial, now);
 		} else if (event == "start") {
-			main.eventUiStart(now);
+			events.post(UiEventKind::Start, UiSource::Serial, now);
 		} else if (event == "stop") {
-			main.eventUiStop(now);
+			events.post(UiEventKind::Stop, UiSource::Serial, now);
 		} else if (event == "pause") {
-			main.eventUiPause(now);
+			events.post(UiEventKind::Pause, UiSource::Serial, now);
 		} else if (event == "rfw") {
-			main.eventUiRotateFw();
+			events.post(UiEventKind::RotateFw, UiSource::Serial, now);
 		} else if (event == "rfw_stop") {
-			main.eventUiRotateFwStop();
+			events.post(UiEventKind::RotateFwStop, UiSource::Serial, now);
 		} else if (event == "rbw") {
-			main.eventUiRotateBw();
+			events.post(UiEventKind::RotateBw, UiSource::Serial, now);
 		} else if (event == "rbw_stop") {
-			main.eventUiRotateBwStop();
+			events.post(UiEventKind::RotateBwStop, UiSource::Serial, now);
 		} else {
 			log("ui: unknown event: ", event);
 		}
@@ -212,7 +471,9 @@ struct UiSerial {
 				return;
 			}
 
-			chambers[*chamberNo - 1].sensor.forceTemp(*temp);
+			link.post({.kind = MainCommandKind::ForceTemp,
+					   .chamber = *chamberNo - 1,
+					   .temp = static_cast<double>(*temp)});
 		} else {
 			log("force: unknown subcommand: ", subcommand);
 		}
@@ -226,6 +487,10 @@ struct UiSerial {
 
 	Timer stateWatchTimer{2_s};
 
-	Main& main;
-	chambers_t& chambers;
+	ControlLink& link;
+	UiEvents& events;
+	ModbusBus& bus;
+	AutonicsTempController& tempController;
+	array<Scheduler*, 2> schedulers;
+	TickMonitor& controlTick;
 };
@@ -3,19 +3,19 @@
 #include <WebServer.h>
 #include <WiFi.h>
 
-#include "Main.h"
+#include "ControlLink.h"
+#include "UiEvents.h"
 #include "kev/Log.h"
 #include "kev/String.h"
 #include "kev/Time.h"
 
 using std::string_view;
 using std::vector;
-using chambers_t = std::array<Chamber, 3>;
 
 template <typename = void>
 struct UiWebImpl {
-	UiWebImpl(Main& main, chambers_t& chambers)
-		: server(80), main(main), chambers(chambers) {}
+	UiWebImpl(ControlLink& link, UiEvents& events)
+		: server(80), link(link), events(events) {}
 
 	void begin() {
 		log("connecting to wifi...");
@@ -23,14 +23,13 @@ struct UiWebImpl {
 		WiFi.mode(WIFI_STA);
 		WiFi.begin("Galaxy", "12345678");
 
-		log.partial_start();
+		auto waited = 0;
 		while (WiFi.status() != WL_CONNECTED) {
 			delay(500);
-			log.partial(".");
+			waited += 500;
 		}
-		log.partial_end();
 
-		log("wifi connected");
+		log("wifi connected after ", waited, "ms");
 		log("ip: ", WiFi.localIP().toString().c_str());
 
 		server.on("/", [this]() { handleRoot(); });
@@ -114,23 +113,23 @@ function log(t) {
 	}
 
 	void handleState() {
+		auto const st = link.read();
 		String json = "{";
 
-		json += "\"state\":\"" + String(main.readStateStr()) + "\",";
+		json += "\"version\":" + String(st.version) + ",";
+		json += "\"state\":\"" + String(mainStateStr(st.state)) + "\",";
+		json += "\"heater\":" + String(st.heater ? "true" : "false") + ",";
 		json +=
-			"\"heater\":" + String(main.readHeater(now) ? "true" : "false") +
-			",";
-		json +=
-			"\"rotation\":" + String(main.readRotation() ? "true" : "false") +
-			",";
+			"\"rotation\":" + String(st.rotation ? "true" : "false") + ",";
 
 		json += "\"chambers\":[";
 		for (int i = 0; i < 3; ++i) {
-			auto temp = main.readTemp(i, now);
+			auto const& temp = st.chambers[i].temp;
 
 			json += "{";
 			json +=
-				"\"fan\":" + String(main.readFan(i) ? "true" : "false") + ",";
+				"\"fan\":" + String(st.chambers[i].fan ? "true" : "false") +
+				",";
 			if (temp) {
 				json += "\"temp\":" + String(*temp);
 			} else {
@@ -177,7 +176,7 @@ function log(t) {
 
 	String handleConfig(vector<string_view> const& tokens) {
 		// For now just print
-		auto const config = main.getConfig();
+		auto const config = link.readDetails().config;
 		String out;
 		out += "Config: ";
 		out += "  preheatTemp: "; out += config.preheatTemp; out += "\n";
@@ -196,21 +195,21 @@ function log(t) {
 		auto e = tokens[1];
 
 		if (e == "preheat")
-			main.eventUiPreheat(now);
+			events.post(UiEventKind::Preheat, UiSource::Web, now);
 		else if (e == "start")
-			main.eventUiStart(now);
+			events.post(UiEventKind::Start, UiSource::Web, now);
 		else if (e == "stop")
-			main.eventUiStop(now);
+			events.post(UiEventKind::Stop, UiSource::Web, now);
 		else if (e == "pause")
-			main.eventUiPause(now);
+			events.post(UiEventKind::Pause, UiSource::Web, now);
 		else if (e == "rfw")
-			main.eventUiRotateFw();
+			events.post(UiEventKind::RotateFw, UiSource::Web, now);
 		else if (e == "rfw_stop")
-			main.eventUiRotateFwStop();
+			events.post(UiEventKind::RotateFwStop, UiSource::Web, now);
 		else if (e == "rbw")
-			main.eventUiRotateBw();
+			events.post(UiEventKind::RotateBw, UiSource::Web, now);
 		else if (e == "rbw_stop")
-			main.eventUiRotateBwStop();
+			events.post(UiEventKind::RotateBwStop, UiSource::Web, now);
 		else
 			return "unknown ui event";
 
@@ -224,25 +223,28 @@ function log(t) {
 		auto chamberNo = kev::parse_int(tokens[2]);
 		auto temp = kev::parse_int(tokens[3]);
 
-		if (!chamberNo || !temp)
+		if (!chamberNo || !temp || *chamberNo < 1 || *chamberNo > 3)
 			return "invalid args";
 
-		chambers[*chamberNo - 1].sensor.forceTemp(*temp);
+		link.post({.kind = MainCommandKind::ForceTemp,
+				   .chamber = *chamberNo - 1,
+				   .temp = static_cast<double>(*temp)});
 		return "ok";
 	}
 
 	String buildStateString() {
+		auto const st = link.read();
 		String out;
 
 		out += "state: ";
-		out += main.readStateStr();
+		out += mainStateStr(st.state);
 		out += "\n";
 
 		out += "heater: ";
-		out += (main.readHeater(now) ? "on\n" : "off\n");
+		out += (st.heater ? "on\n" : "off\n");
 
 		for (int i = 0; i < 3; ++i) {
-			auto temp = main.readTemp(i, now);
+			auto const& temp = st.chambers[i].temp;
 			out += "chamber ";
 			out += i + 1;
 			out += ": ";
@@ -262,8 +264,8 @@ function log(t) {
 	WebServer server;
 	kev::Log<> log{"web"};
 
-	Main& main;
-	chambers_t& chambers;
+	ControlLink& link;
+	UiEvents& events;
 
 	kev::Timestamp now{};
 };
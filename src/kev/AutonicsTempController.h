@@ -1,97 +1,293 @@
 #pragma once
 
-#include <RS485.h>
-#include <errno.h>
-#include <libmodbus/modbus-rtu.h>
 #include <optional>
 
 #include "kev/Log.h"
+#include "kev/ModbusBus.h"
+#include "kev/SeqLock.h"
+#include "kev/Spsc.h"
 #include "kev/Timer.h"
 
 namespace kev {
 
 using std::optional;
 
-constexpr auto AUTONICS_SPEED = 38400;
-constexpr auto AUTONICS_SERIAL_CONFIG = SERIAL_8N1;
-constexpr auto AUTONICS_MODBUS_TIMEOUT_US = 30000;       // 30ms
-constexpr auto AUTONICS_MODBUS_BYTE_TIMEOUT_US = 30000;  // 30ms
+// Answer delay allowed on top of the wire time, the controller's own
+// response waiting time setting plus some margin
+constexpr auto AUTONICS_TURNAROUND = 30_ms;
 constexpr auto AUTONICS_SV_ADDRESS = 0x0000;             // holding reg
 constexpr auto AUTONICS_RUN_ADDRESS = 0x0032;            // holding reg
 constexpr auto AUTONICS_PV_ADDRESS = 0x03E8;             // input reg
 constexpr auto AUTONICS_OUT1_ADDRESS = 0x0003;           // input bit
+constexpr auto AUTONICS_SNAPSHOT_PERIOD = 1500_ms;
+constexpr auto AUTONICS_SNAPSHOT_MAX_AGE = 5_s;
+// SV and RUN are only written by us, read them back now and then to catch
+// changes made on the front panel
+constexpr auto AUTONICS_VERIFY_PERIOD = 10_s;
+// Writes asked for by the control task and not yet queued on the bus,
+// picked up this often
+constexpr auto AUTONICS_WRITE_QUEUE = 8;
+constexpr auto AUTONICS_WRITE_POLL = 10_ms;
 
+// Everything we read from the controller. PV and OUT1 come from the same
+// poll cycle, SV and RUN from the latest verify cycle.
+struct AutonicsSnapshot {
+	int pv = 0;
+	bool out1 = false;
+	int sv = 0;
+	bool running = false;
+	Timestamp at = {};
+};
+
+struct AutonicsWriteStats {
+	unsigned long writes = 0;
+	unsigned long suppressed = 0;  // Value was already set
+	unsigned long outOfBand = 0;   // Changed behind our back and restored
+	unsigned long retries = 0;     // Our own write didn't make it, resent
+};
+
+// What the control task gets to see of the bus side
+struct AutonicsShared {
+	optional<AutonicsSnapshot> snapshot = {};
+	bool running = false;
+};
+
+struct AutonicsWrite {
+	uint16_t address;
+	uint16_t value;
+};
+
+// Write-through cache of a holding register owned by the firmware
+struct AutonicsRegister {
+	uint16_t address;
+	optional<uint16_t> desired = {};  // Last value the firmware asked for
+	optional<uint16_t> latest = {};   // Device value once queued writes land
+	int inFlight = 0;
+	// `desired` still has to go out: the bus queue was full or the write
+	// failed. Retried on every tick while the controller is reachable.
+	bool pendingWrite = false;
+};
+
+// tick() and the bus callbacks run on the comms task. setSv(), setRun() and
+// the readers may be called from the control task: writes go through a
+// queue that the next tick() drains, reads come from a published copy.
 template <typename = void>
 struct AutonicsTempControllerImpl {
-	AutonicsTempControllerImpl(RS485Class* rs485, uint8_t address) {
-		mb = modbus_new_rtu(rs485, AUTONICS_SPEED, AUTONICS_SERIAL_CONFIG);
-		modbus_set_slave(mb, address);
-	}
+	AutonicsTempControllerImpl(ModbusBus& bus, uint8_t address)
+		: mb{bus, address, AUTONICS_TURNAROUND, ModbusPriority::Control} {}
+
+	// Queues a snapshot poll every AUTONICS_SNAPSHOT_PERIOD. PV and OUT1 use
+	// different function codes, and SV and RUN are far apart with undefined
+	// registers in between, so a cycle is two frames, four on verify cycles,
+	// sent back to back and committed together once the last one is in.
+	auto tick(Timestamp now) -> void {
+		while (auto const w = writes.pop()) {
+			write(w->address == sv.address ? sv : run, w->value);
+		}
+		// With the breaker open they would only fail again, the snapshot
+		// polls probe the controller meanwhile
+		for (auto* reg : {&sv, &run}) {
+			if (reg->pendingWrite && reg->desired && mb.isReachable() &&
+				write(*reg, *reg->desired)) {
+				++stats.retries;
+			}
+		}
+
+		if (!snapshotTimer.isDone(now) || pendingReads > 0) {
+			return;
+		}
+		snapshotTimer.reset(now);
 
-	auto begin() -> void { modbus_connect(mb); }
+		auto const done =
+			ModbusCompletion::bind<&AutonicsTempControllerImpl::onRead>(this);
+		readFailed = false;
+		countSubmit(mb.readInputRegisters(AUTONICS_PV_ADDRESS, 1, done));
+		countSubmit(mb.readInputBits(AUTONICS_OUT1_ADDRESS, 1, done));
 
-	auto setSv(int sv) -> void {
-		delay(1);
-		modbus_write_register(mb, AUTONICS_SV_ADDRESS, sv);
-		if (errno) {
-			log_("Failed to set SV: ", strerror(errno));
+		if (verifyTimer.isDone(now)) {
+			verifyTimer.reset(now);
+			countSubmit(mb.readRegisters(sv.address, 1, done));
+			countSubmit(mb.readRegisters(run.address, 1, done));
 		}
 	}
 
-	auto readPv(Timestamp now) -> std::optional<int> {
-		if (pvTimer.isDone(now)) {
-			pvTimer.reset(now);
-			uint16_t pv;
-			delay(1);
-			modbus_read_input_registers(mb, AUTONICS_PV_ADDRESS, 1, &pv);
-			if (errno) {
-				log_("Failed to read PV: ", strerror(errno));
-				return std::nullopt;
-			}
-			return lastPv = static_cast<int>(pv);
+	// When tick() has something to do next
+	auto nextDeadline(Timestamp now) const -> Timestamp {
+		return earliest(snapshotTimer.deadline(), now + AUTONICS_WRITE_POLL);
+	}
+
+	// Latest snapshot, as long as it is not older than maxAge
+	auto snapshot(Timestamp now, Duration maxAge = AUTONICS_SNAPSHOT_MAX_AGE)
+		-> optional<AutonicsSnapshot> {
+		auto const last = shared.read().snapshot;
+		if (!last || (now - last->at) > maxAge) {
+			return {};
 		}
-		return lastPv;
+		return last;
 	}
 
-	auto readOut1(Timestamp now) -> std::optional<bool> {
-		if (out1Timer.isDone(now)) {
-			out1Timer.reset(now);
-			uint8_t out1;
-			delay(1);
-			modbus_read_input_bits(mb, AUTONICS_OUT1_ADDRESS, 1, &out1);
-			if (errno) {
-				log_("Failed to read output: ", strerror(errno));
-				return std::nullopt;
-			}
-			return lastOut1 = out1;
+	auto readPv(Timestamp now, Duration maxAge = AUTONICS_SNAPSHOT_MAX_AGE)
+		-> optional<int> {
+		auto const snap = snapshot(now, maxAge);
+		if (!snap) {
+			return {};
 		}
-		return lastOut1;
+		return snap->pv;
 	}
 
-	auto setRun(bool run) -> void {
-		auto const value = run ? 0 : 1;  // 0: run, 1: stop
-		delay(1);
-		modbus_write_register(mb, AUTONICS_RUN_ADDRESS, value);
-		if (errno) {
-			log_("Failed to set run: ", strerror(errno));
-			return;
+	auto readOut1(Timestamp now, Duration maxAge = AUTONICS_SNAPSHOT_MAX_AGE)
+		-> optional<bool> {
+		auto const snap = snapshot(now, maxAge);
+		if (!snap) {
+			return {};
 		}
+		return snap->out1;
+	}
 
-		running = run;
+	// Writes are skipped when the device already has (or is about to have)
+	// the value. Back to back different values are still all sent in order.
+	auto setSv(int value) -> void {
+		post(sv, static_cast<uint16_t>(value));
+	}
+
+	auto setRun(bool value) -> void {
+		post(run, value ? 0 : 1);  // 0: run, 1: stop
 	}
 
 	auto isRunning() -> bool {
-		return running;
+		return shared.read().running;
 	}
 
+	// Comms task only
+	auto writeStats() const -> AutonicsWriteStats const& { return stats; }
+
    private:
-	modbus_t* mb;
+	auto post(AutonicsRegister const& reg, uint16_t value) -> void {
+		if (!writes.push({reg.address, value})) {
+			log_.warn("write queue full, dropped @", reg.address, " = ", value);
+		}
+	}
+
+	auto publish() -> void {
+		shared.write({.snapshot = lastSnapshot, .running = running});
+	}
+
+	auto countSubmit(bool submitted) -> void {
+		if (submitted) {
+			++pendingReads;
+		} else {
+			readFailed = true;
+		}
+	}
+
+	// True when the write went onto the bus
+	auto write(AutonicsRegister& reg, uint16_t value) -> bool {
+		reg.desired = value;
+		if (reg.latest == value) {
+			reg.pendingWrite = false;
+			++stats.suppressed;
+			return false;
+		}
+
+		auto const done =
+			ModbusCompletion::bind<&AutonicsTempControllerImpl::onWrite>(this);
+		reg.pendingWrite = !mb.writeRegister(reg.address, value, done);
+		if (reg.pendingWrite) {
+			return false;  // Bus queue is full, the next tick tries again
+		}
+		++reg.inFlight;
+		reg.latest = value;
+		++stats.writes;
+		return true;
+	}
+
+	auto onWrite(ModbusTransaction const& tx, Timestamp) -> void {
+		auto& reg = tx.address == sv.address ? sv : run;
+		--reg.inFlight;
+
+		if (!tx.ok()) {
+			// The bus already reports the breaker, the write waits for it
+			if (tx.result != ModbusResult::Unreachable) {
+				log_.warn("Failed to set @", tx.address, ": ",
+						  modbusResultStr(tx.result));
+			}
+			// Unknown now, so the next write goes out for sure. Unless a
+			// newer value went out meanwhile, this one has to go again.
+			reg.latest = {};
+			if (reg.desired == tx.regs[0]) {
+				reg.pendingWrite = true;
+			}
+			return;
+		}
+
+		if (&reg == &run) {
+			running = tx.regs[0] == 0;
+			publish();
+		}
+	}
+
+	auto onVerify(AutonicsRegister& reg, uint16_t value) -> void {
+		if (reg.inFlight > 0 || reg.pendingWrite) {
+			return;  // Our own write isn't in yet, check again next time
+		}
+
+		reg.latest = value;
+		if (reg.desired && *reg.desired != value) {
+			log_("@", reg.address, " changed to ", value,
+				 " outside of the firmware, restoring ", *reg.desired);
+			++stats.outOfBand;
+			write(reg, *reg.desired);
+		}
+	}
+
+	auto onRead(ModbusTransaction const& tx, Timestamp now) -> void {
+		--pendingReads;
+
+		if (!tx.ok()) {
+			log_.warn("Failed to read @", tx.address, ": ",
+				 modbusResultStr(tx.result));
+			readFailed = true;
+		} else if (tx.function == ModbusFunction::ReadInputRegisters) {
+			nextSnapshot.pv = static_cast<int>(tx.regs[0]);
+		} else if (tx.function == ModbusFunction::ReadDiscreteInputs) {
+			nextSnapshot.out1 = tx.bits[0] != 0;
+		} else if (tx.address == sv.address) {
+			nextSnapshot.sv = static_cast<int>(tx.regs[0]);
+			onVerify(sv, tx.regs[0]);
+		} else if (tx.address == run.address) {
+			nextSnapshot.running = tx.regs[0] == 0;
+			if (run.inFlight == 0) {
+				running = nextSnapshot.running;
+			}
+			onVerify(run, tx.regs[0]);
+		}
+
+		if (pendingReads > 0) {
+			return;
+		}
+
+		// Only publish complete snapshots, a partial one ages out instead
+		if (!readFailed) {
+			nextSnapshot.at = now;
+			lastSnapshot = nextSnapshot;
+		}
+		publish();
+	}
+
+	ModbusSlave mb;
 	Log<> log_{"AutonicsTempController"};
-	Timer pvTimer{1500_ms};
-	Timer out1Timer{1500_ms};
-	optional<bool> lastOut1{false};
-	optional<int> lastPv{0};
+	Timer snapshotTimer{AUTONICS_SNAPSHOT_PERIOD};
+	Timer verifyTimer{AUTONICS_VERIFY_PERIOD};
+	AutonicsRegister sv{AUTONICS_SV_ADDRESS};
+	AutonicsRegister run{AUTONICS_RUN_ADDRESS};
+	AutonicsWriteStats stats{};
+	int pendingReads{0};
+	bool readFailed{false};
+	AutonicsSnapshot nextSnapshot{};
+	optional<AutonicsSnapshot> lastSnapshot{};
 	bool running{false};
+	SpscQueue<AutonicsWrite, AUTONICS_WRITE_QUEUE> writes;
+	SeqLock<AutonicsShared> shared;
 };
 
 using AutonicsTempController = AutonicsTempControllerImpl<>;
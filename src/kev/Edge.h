@@ -84,7 +84,7 @@ class EdgeDebounced {
 	Reader& reader;
 	Duration dur;
 	Timestamp lastChange = 0;
-	Log<false> log{"EdgeDebounced"};
+	Log<LogLevel::Off> log{"EdgeDebounced"};
 	bool prev;
 	bool curr;
 	bool _changed = false;
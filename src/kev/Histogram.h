@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kev {
+
+// Four buckets per power of two, so a percentile is off by at most a
+// quarter, up to about 16 s
+constexpr auto HISTOGRAM_BUCKETS = size_t{96};
+
+struct HistogramSummary {
+	unsigned long count = 0;
+	long min = 0;
+	long mean = 0;
+	long max = 0;
+	long p50 = 0;
+	long p99 = 0;
+};
+
+// Distribution of times in µs, for the tail the averages hide. One task
+// records, any task reads. A reader asks for a reset and the recording side
+// carries it out before its next sample, so the two never race on the
+// buckets.
+template <typename = void>
+struct HistogramImpl {
+	// Recording side
+	auto record(long us) -> void {
+		if (resetPending.exchange(false, std::memory_order_acquire)) {
+			clear();
+		}
+		auto const n = count.load(std::memory_order_relaxed);
+		if (n == 0 || us < min.load(std::memory_order_relaxed)) {
+			min.store(us, std::memory_order_relaxed);
+		}
+		if (n == 0 || us > max.load(std::memory_order_relaxed)) {
+			max.store(us, std::memory_order_relaxed);
+		}
+		sum.fetch_add(us, std::memory_order_relaxed);
+		buckets[bucketOf(std::max(us, 0l))].fetch_add(
+			1, std::memory_order_relaxed);
+		count.store(n + 1, std::memory_order_release);
+	}
+
+	// Any task. Counts that change meanwhile may make it a sample off, and
+	// after reset() it's empty even before the recording side caught up.
+	auto summary() const -> HistogramSummary {
+		auto const n = count.load(std::memory_order_acquire);
+		if (n == 0 || resetPending.load(std::memory_order_acquire)) {
+			return {};
+		}
+		auto const hi = max.load(std::memory_order_relaxed);
+		return {
+			.count = n,
+			.min = min.load(std::memory_order_relaxed),
+			.mean = sum.load(std::memory_order_relaxed) / static_cast<long>(n),
+			.max = hi,
+			.p50 = std::min(percentile(n, 50), hi),
+			.p99 = std::min(percentile(n, 99), hi),
+		};
+	}
+
+	auto reset() -> void {
+		resetPending.store(true, std::memory_order_release);
+	}
+
+   private:
+	static auto bucketOf(long us) -> size_t {
+		auto const v = static_cast<uint32_t>(us);
+		if (v < 4) {
+			return v;
+		}
+		auto const msb = 31 - __builtin_clz(v);
+		auto const sub = (v >> (msb - 2)) & 3;
+		return std::min(static_cast<size_t>((msb - 1) * 4 + sub),
+						HISTOGRAM_BUCKETS - 1);
+	}
+
+	// Last µs that still falls into bucket i
+	static auto upperOf(size_t i) -> long {
+		if (i < 3) {
+			return static_cast<long>(i);
+		}
+		auto const next = i + 1;
+		auto const msb = next / 4 + 1;
+		return static_cast<long>((4 + next % 4) << (msb - 2)) - 1;
+	}
+
+	auto percentile(unsigned long n, unsigned long pct) const -> long {
+		auto const rank = (n * pct + 99) / 100;
+		auto seen = 0ul;
+		for (auto i = size_t{0}; i < HISTOGRAM_BUCKETS; ++i) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank) {
+				return upperOf(i);
+			}
+		}
+		return max.load(std::memory_order_relaxed);
+	}
+
+	auto clear() -> void {
+		for (auto& b : buckets) {
+			b.store(0, std::memory_order_relaxed);
+		}
+		sum.store(0, std::memory_order_relaxed);
+		min.store(0, std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+		count.store(0, std::memory_order_release);
+	}
+
+	std::array<std::atomic<uint32_t>, HISTOGRAM_BUCKETS> buckets{};
+	std::atomic<unsigned long> count{0};
+	std::atomic<long> sum{0};
+	std::atomic<long> min{0};
+	std::atomic<long> max{0};
+	std::atomic<bool> resetPending{false};
+};
+
+using Histogram = HistogramImpl<>;
+
+}  // namespace kev
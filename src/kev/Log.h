@@ -1,63 +1,388 @@
 #pragma once
+#include <Arduino.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string_view>
 #include <type_traits>
 #include "HardwareSerial.h"
 
 #define INLINE __attribute__((always_inline)) inline
 
+// Highest level compiled in for every module, on top of the module's own
+#ifndef KEV_LOG_MAX_LEVEL
+#define KEV_LOG_MAX_LEVEL 4
+#endif
+
 namespace kev {
 
-INLINE auto print() -> void {}
+enum class LogLevel { Off, Error, Warn, Info, Debug };
+
+// Log calls don't print, they copy the arguments into a record in this ring
+// and logDrain() formats and prints them later, only as much as fits the
+// serial TX buffer. So logging from the control path costs a memcpy and
+// never waits for the 115200 baud port.
+constexpr auto LOG_RING_SIZE = 32u;
+constexpr auto LOG_RECORD_BYTES = 80u;
+// What Serial.availableForWrite() reports with nothing queued, the ESP32
+// UART FIFO as no TX buffer is set up
+constexpr auto LOG_TX_CAPACITY = 128u;
+constexpr auto LOG_LINE_MAX = 128u;
+// A longer line would never find room and block the ring for good
+static_assert(LOG_LINE_MAX <= LOG_TX_CAPACITY);
+
+// Prints a 16 bit value in binary
+struct LogBits {
+	uint16_t value;
+};
+
+struct LogStats {
+	unsigned long written = 0;
+	unsigned long dropped = 0;    // Ring was full
+	unsigned long truncated = 0;  // Arguments didn't fit a record
+	unsigned maxDepth = 0;
+};
 
-template <class T, class... Args>
-INLINE auto print(T head, Args... tail) -> void {
-	if constexpr (std::is_same_v<std::remove_reference_t<T>,
-								 std::string_view>) {
-		Serial.write(head.data(), head.size());
-	} else {
-		Serial.print(head);
+struct LogLine {
+	char text[LOG_LINE_MAX];
+	size_t len = 0;
+
+	template <class... Args>
+	auto printf(char const* format, Args... args) -> void {
+		auto const n =
+			std::snprintf(text + len, sizeof(text) - len, format, args...);
+		if (n > 0) {
+			len = std::min(len + static_cast<size_t>(n), sizeof(text) - 1);
+		}
 	}
-	print(tail...);
-}
+
+	// Ends the line, cutting off its last character if it is full
+	auto finish() -> void {
+		len = std::min(len, sizeof(text) - 2);
+		text[len++] = '\n';
+		text[len] = '\0';
+	}
+};
+
+struct LogWriter {
+	uint8_t* data;
+	size_t used = 0;
+	bool truncated = false;
+
+	auto put(void const* value, size_t size) -> void {
+		if (truncated || used + size > LOG_RECORD_BYTES) {
+			truncated = true;
+			return;
+		}
+		std::memcpy(data + used, value, size);
+		used += size;
+	}
+
+	// Copied, as it may point into a buffer that is gone by drain time
+	auto putString(char const* str, size_t len) -> void {
+		if (truncated || used + 1 > LOG_RECORD_BYTES) {
+			truncated = true;
+			return;
+		}
+		auto const room = LOG_RECORD_BYTES - used - 1;
+		auto const n =
+			static_cast<uint8_t>(std::min({len, room, size_t{255}}));
+		put(&n, 1);
+		put(str, n);
+		truncated = n < len;
+	}
+};
+
+struct LogReader {
+	uint8_t const* data;
+	size_t size;
+	size_t used = 0;
+
+	auto get(void* value, size_t n) -> bool {
+		if (used + n > size) {
+			return false;
+		}
+		std::memcpy(value, data + used, n);
+		used += n;
+		return true;
+	}
+
+	auto getString(LogLine& line) -> bool {
+		auto n = uint8_t{0};
+		if (!get(&n, 1) || used + n > size) {
+			return false;
+		}
+		line.printf("%.*s", static_cast<int>(n), data + used);
+		used += n;
+		return true;
+	}
+};
+
+// How each argument type is stored in a record and printed from it
+template <class T, class = void>
+struct LogArg;
+
+// The LogArg for an argument as passed. Arrays keep their const, it tells a
+// literal from a buffer.
+template <class T, class U = std::remove_reference_t<T>>
+using LogArgOf =
+	std::conditional_t<std::is_array_v<U>, U, std::remove_cv_t<U>>;
+
+template <>
+struct LogArg<char> {
+	static auto put(LogWriter& w, char c) -> void { w.put(&c, 1); }
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		auto c = char{};
+		if (!r.get(&c, 1)) {
+			return false;
+		}
+		line.printf("%c", c);
+		return true;
+	}
+};
+
+template <class T>
+struct LogArg<T, std::enable_if_t<std::is_arithmetic_v<T> ||
+								  std::is_enum_v<T>>> {
+	static auto put(LogWriter& w, T value) -> void { w.put(&value, sizeof(T)); }
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		auto value = T{};
+		if (!r.get(&value, sizeof(T))) {
+			return false;
+		}
+		if constexpr (std::is_floating_point_v<T>) {
+			line.printf("%.2f", static_cast<double>(value));
+		} else if constexpr (std::is_enum_v<T> || std::is_signed_v<T>) {
+			line.printf("%ld", static_cast<long>(value));
+		} else {
+			line.printf("%lu", static_cast<unsigned long>(value));
+		}
+		return true;
+	}
+};
+
+template <>
+struct LogArg<LogBits> {
+	static auto put(LogWriter& w, LogBits bits) -> void {
+		w.put(&bits.value, sizeof(bits.value));
+	}
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		auto value = uint16_t{};
+		if (!r.get(&value, sizeof(value))) {
+			return false;
+		}
+		for (int i = 15; i >= 0; i--) {
+			line.printf("%c", (value >> i) & 1 ? '1' : '0');
+		}
+		return true;
+	}
+};
+
+// String literals live forever, only the pointer is stored. Don't log a
+// const char array on the stack, it would be taken for one.
+template <size_t N>
+struct LogArg<char const[N]> {
+	static auto put(LogWriter& w, char const (&str)[N]) -> void {
+		auto const ptr = static_cast<char const*>(str);
+		w.put(&ptr, sizeof(ptr));
+	}
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		auto ptr = static_cast<char const*>(nullptr);
+		if (!r.get(&ptr, sizeof(ptr))) {
+			return false;
+		}
+		line.printf("%s", ptr);
+		return true;
+	}
+};
+
+// A char buffer is copied, it may be reused or gone by drain time
+template <size_t N>
+struct LogArg<char[N]> {
+	static auto put(LogWriter& w, char const (&str)[N]) -> void {
+		w.putString(str, strnlen(str, N));
+	}
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		return r.getString(line);
+	}
+};
+
+template <>
+struct LogArg<std::string_view> {
+	static auto put(LogWriter& w, std::string_view str) -> void {
+		w.putString(str.data(), str.size());
+	}
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		return r.getString(line);
+	}
+};
+
+template <>
+struct LogArg<char const*> {
+	static auto put(LogWriter& w, char const* str) -> void {
+		w.putString(str, std::strlen(str));
+	}
+	static auto print(LogReader& r, LogLine& line) -> bool {
+		return r.getString(line);
+	}
+};
+
+template <>
+struct LogArg<char*> : LogArg<char const*> {};
+
+using LogFormat = void (*)(LogReader&, LogLine&);
 
 template <class... Args>
-INLINE auto println(Args... args) -> void {
-	print(args..., '\n');
+auto logFormat(LogReader& r, LogLine& line) -> void {
+	if (!(LogArg<Args>::print(r, line) && ...)) {
+		line.printf("...");
+	}
 }
 
-template <bool enabled = true>
+struct LogRecord {
+	std::atomic<bool> ready{false};
+	LogLevel level;
+	char const* name;
+	unsigned long at;
+	LogFormat format;
+	uint8_t size;
+	uint8_t data[LOG_RECORD_BYTES];
+};
+
+// Multiple producers, one consumer. Producers reserve a slot by moving head
+// and publish it with `ready`, the consumer frees it by moving tail.
+struct LogRing {
+	template <class... Args>
+	auto push(LogLevel level, char const* name, Args&&... args) -> void {
+		auto idx = head.load(std::memory_order_relaxed);
+		do {
+			if (idx - tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		} while (!head.compare_exchange_weak(idx, idx + 1,
+											 std::memory_order_acq_rel));
+
+		auto& rec = records[idx % LOG_RING_SIZE];
+		auto w = LogWriter{rec.data};
+		(LogArg<LogArgOf<Args>>::put(w, args), ...);
+		rec.level = level;
+		rec.name = name;
+		rec.at = millis();
+		rec.format = &logFormat<LogArgOf<Args>...>;
+		rec.size = static_cast<uint8_t>(w.used);
+		if (w.truncated) {
+			truncated.fetch_add(1, std::memory_order_relaxed);
+		}
+		rec.ready.store(true, std::memory_order_release);
+
+		// Wraps when drain() already took this record, skip it then
+		auto const depth = idx + 1 - tail.load(std::memory_order_acquire);
+		auto max = maxDepth.load(std::memory_order_relaxed);
+		while (depth <= LOG_RING_SIZE && depth > max &&
+			   !maxDepth.compare_exchange_weak(max, depth)) {
+		}
+	}
+
+	// Prints records while the serial TX buffer has room for them, or all
+	// of them when blocking is fine (setup, crashes)
+	auto drain(bool block = false) -> void {
+		auto t = tail.load(std::memory_order_relaxed);
+		while (t != head.load(std::memory_order_acquire)) {
+			auto& rec = records[t % LOG_RING_SIZE];
+			if (!rec.ready.load(std::memory_order_acquire)) {
+				return;  // Still being written
+			}
+
+			auto line = LogLine{};
+			line.printf("%lu [%s] %s", rec.at, rec.name, levelPrefix(rec));
+			auto r = LogReader{rec.data, rec.size};
+			rec.format(r, line);
+			line.finish();
+
+			if (!block && Serial.availableForWrite() <
+							  static_cast<int>(line.len)) {
+				return;  // Try again on the next drain
+			}
+			Serial.write(line.text, line.len);
+
+			rec.ready.store(false, std::memory_order_relaxed);
+			tail.store(++t, std::memory_order_release);
+			written.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	auto stats() const -> LogStats {
+		return {written.load(), dropped.load(), truncated.load(),
+				maxDepth.load()};
+	}
+
+	// Tail first, head never falls behind it
+	auto depth() const -> unsigned {
+		auto const t = tail.load();
+		return std::min(head.load() - t, LOG_RING_SIZE);
+	}
+
+   private:
+	static auto levelPrefix(LogRecord const& rec) -> char const* {
+		switch (rec.level) {
+		case LogLevel::Error: return "error: ";
+		case LogLevel::Warn: return "warning: ";
+		default: return "";
+		}
+	}
+
+	LogRecord records[LOG_RING_SIZE];
+	std::atomic<unsigned> head{0};
+	std::atomic<unsigned> tail{0};
+	std::atomic<unsigned long> written{0};
+	std::atomic<unsigned long> dropped{0};
+	std::atomic<unsigned long> truncated{0};
+	std::atomic<unsigned> maxDepth{0};
+};
+
+inline LogRing logRing;
+
+inline auto logDrain(bool block = false) -> void { logRing.drain(block); }
+
+// Per module logger, messages above `level` (or KEV_LOG_MAX_LEVEL) compile
+// to nothing
+template <LogLevel level = LogLevel::Info>
 struct Log {
 	Log(char const* name) : name{name} {}
 
 	template <class... Args>
-	INLINE auto operator()(Args... args) -> void {
-		if (enabled) {
-			println('[', name, ']', ' ', args...);
-		}
+	INLINE auto operator()(Args&&... args) -> void {
+		write<LogLevel::Info>(args...);
 	}
 
 	template <class... Args>
-	INLINE auto partial_start() -> void {
-		if (enabled) {
-			print('[', name, ']', ' ');
-		}
+	INLINE auto error(Args&&... args) -> void {
+		write<LogLevel::Error>(args...);
 	}
 
 	template <class... Args>
-	INLINE auto partial_end() -> void {
-		if (enabled) {
-			println();
-		}
+	INLINE auto warn(Args&&... args) -> void {
+		write<LogLevel::Warn>(args...);
 	}
 
 	template <class... Args>
-	INLINE auto partial(Args... args) -> void {
-		if (enabled) {
-			print(args...);
-		}
+	INLINE auto debug(Args&&... args) -> void {
+		write<LogLevel::Debug>(args...);
 	}
 
    private:
+	template <LogLevel at, class... Args>
+	INLINE auto write(Args&&... args) -> void {
+		if constexpr (at <= level &&
+					  static_cast<int>(at) <= KEV_LOG_MAX_LEVEL) {
+			logRing.push(at, name, args...);
+		}
+	}
+
 	char const* name;
 };
 
@@ -0,0 +1,679 @@
+#pragma once
+
+#include <Arduino.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+
+#include "kev/Log.h"
+#include "kev/ModbusRtu.h"
+#include "kev/Time.h"
+
+namespace kev {
+
+using namespace kev::literals;
+using std::optional;
+
+constexpr auto MODBUS_QUEUE_SIZE = 6;  // Per priority class
+constexpr auto MODBUS_MAX_TAGS = 12;  // Slave and function pairs tracked
+constexpr auto MODBUS_UTILIZATION_WINDOW = 10;  // Seconds
+constexpr auto MODBUS_MAX_SLAVES = 4;  // Slaves with a circuit breaker
+constexpr auto MODBUS_BREAKER_THRESHOLD = 3u;  // Timeouts in a row to open
+constexpr auto MODBUS_BREAKER_MIN_BACKOFF = 500_ms;
+constexpr auto MODBUS_BREAKER_MAX_BACKOFF = 8_s;
+
+// Served in this order, unless a lower class has been waiting past its
+// deadline, in which case it goes first so it can't starve
+enum class ModbusPriority : uint8_t {
+	Control,   // Safety and heater control
+	Input,     // HMI input polling and screen navigation
+	Cosmetic,  // Periodic screen refreshes
+
+	Max,
+};
+
+constexpr auto MODBUS_PRIORITIES = static_cast<size_t>(ModbusPriority::Max);
+
+constexpr std::array<Duration, MODBUS_PRIORITIES> MODBUS_DEADLINES = {
+	50_ms,    // Control
+	100_ms,   // Input
+	1000_ms,  // Cosmetic
+};
+
+inline auto modbusPriorityStr(ModbusPriority priority) -> char const* {
+	switch (priority) {
+	case ModbusPriority::Control: return "control";
+	case ModbusPriority::Input: return "input";
+	case ModbusPriority::Cosmetic: return "cosmetic";
+	case ModbusPriority::Max: break;
+	}
+	return "unknown";
+}
+
+struct ModbusTransaction;
+
+struct ModbusCompletion {
+	using Fn = void (*)(void* ctx, ModbusTransaction const& tx, Timestamp now);
+
+	Fn fn = nullptr;
+	void* ctx = nullptr;
+
+	// Adapt a member function `auto f(ModbusTransaction const&, Timestamp)`
+	template <auto method, class T>
+	static auto bind(T* self) -> ModbusCompletion {
+		return {[](void* ctx, ModbusTransaction const& tx, Timestamp now) {
+					(static_cast<T*>(ctx)->*method)(tx, now);
+				},
+				self};
+	}
+};
+
+// A request as it waits in the bus queues
+struct ModbusTransaction : ModbusRequest {
+	ModbusPriority priority = ModbusPriority::Control;
+	ModbusCompletion done = {};
+	Timestamp queuedAt = {};
+};
+
+struct ModbusClassStats {
+	unsigned long transactions = 0;
+	unsigned long deadlineMisses = 0;
+	unsigned long dropped = 0;
+	Duration totalWait = 0;  // Queued until the first byte goes out
+	Duration maxWait = 0;
+	Duration totalLatency = 0;  // Queued until completion
+	Duration maxLatency = 0;
+	unsigned long txBytes = 0;
+	unsigned long rxBytes = 0;
+	uint64_t busyUs = 0;  // First byte out until completion
+};
+
+// Round trip times, first request byte out until the response is in. Fixed
+// buckets so recording is a couple of compares and no allocation.
+constexpr std::array<unsigned long, 16> MODBUS_LATENCY_BUCKETS_US = {
+	1000,  2000,  3000,  5000,   7000,   10000,  15000,  20000,
+	30000, 50000, 70000, 100000, 150000, 200000, 300000, 500000,
+};
+
+struct ModbusLatencyHistogram {
+	// One more than the bounds, for everything above the last one
+	std::array<unsigned long, MODBUS_LATENCY_BUCKETS_US.size() + 1> counts =
+		{};
+	unsigned long maxUs = 0;
+
+	auto add(unsigned long us) -> void {
+		auto i = size_t{0};
+		while (i < MODBUS_LATENCY_BUCKETS_US.size() &&
+			   us > MODBUS_LATENCY_BUCKETS_US[i]) {
+			++i;
+		}
+		++counts[i];
+		maxUs = std::max(maxUs, us);
+	}
+
+	auto total() const -> unsigned long {
+		auto sum = 0ul;
+		for (auto const c : counts) {
+			sum += c;
+		}
+		return sum;
+	}
+
+	// Upper bound of the bucket holding the given percentile, the max for
+	// the overflow bucket
+	auto percentileUs(unsigned percent) const -> unsigned long {
+		auto const n = total();
+		if (n == 0) {
+			return 0;
+		}
+		auto const rank = (n * percent + 99) / 100;
+		auto seen = 0ul;
+		for (auto i = size_t{0}; i < MODBUS_LATENCY_BUCKETS_US.size(); ++i) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return std::min(MODBUS_LATENCY_BUCKETS_US[i], maxUs);
+			}
+		}
+		return maxUs;
+	}
+};
+
+// Everything about one kind of transaction to one slave
+struct ModbusTagStats {
+	uint8_t slave = 0;
+	ModbusFunction function = ModbusFunction::ReadCoils;
+	unsigned long transactions = 0;
+	unsigned long timeouts = 0;
+	unsigned long crcErrors = 0;
+	unsigned long otherErrors = 0;  // Bad response or exception
+	unsigned long txBytes = 0;
+	unsigned long rxBytes = 0;
+	ModbusLatencyHistogram latency = {};  // Successful ones only
+};
+
+// Busy time per second over the last MODBUS_UTILIZATION_WINDOW seconds
+struct ModbusUtilization {
+	auto add(Timestamp now, unsigned long busyUs) -> void {
+		advance(now);
+		busy[current] += busyUs;
+	}
+
+	// The current second is still filling up, so it's left out
+	auto percent(Timestamp now) -> double {
+		advance(now);
+		auto total = uint64_t{0};
+		for (auto i = size_t{0}; i < busy.size(); ++i) {
+			total += i == current ? 0 : busy[i];
+		}
+		auto const seconds = std::min<size_t>(filled, busy.size() - 1);
+		return seconds ? total / 10000.0 / seconds : 0;
+	}
+
+	auto reset(Timestamp now) -> void {
+		busy = {};
+		current = 0;
+		filled = 0;
+		secondStart = now;
+	}
+
+   private:
+	auto advance(Timestamp now) -> void {
+		auto steps = 0u;
+		while ((now - secondStart) >= 1_s && steps++ < busy.size()) {
+			current = (current + 1) % busy.size();
+			busy[current] = 0;
+			secondStart = secondStart + 1_s;
+			++filled;
+		}
+		if ((now - secondStart) >= 1_s) {
+			secondStart = now;  // Idle for longer than the window
+		}
+	}
+
+	std::array<unsigned long, MODBUS_UTILIZATION_WINDOW + 1> busy = {};
+	size_t current = 0;
+	size_t filled = 0;
+	Timestamp secondStart = {};
+};
+
+enum class ModbusBreakerState : uint8_t {
+	Closed,    // Traffic flows
+	Open,      // Everything fails right away until the next probe
+	HalfOpen,  // One probe is on the wire
+};
+
+inline auto modbusBreakerStateStr(ModbusBreakerState state) -> char const* {
+	switch (state) {
+	case ModbusBreakerState::Closed: return "closed";
+	case ModbusBreakerState::Open: return "open";
+	case ModbusBreakerState::HalfOpen: return "half-open";
+	}
+	return "unknown";
+}
+
+// Keeps a slave that stopped answering, e.g. the panel while it reboots, from
+// costing a full response timeout on every transaction. After enough
+// timeouts in a row the breaker opens and its transactions fail without
+// touching the line. Now and then one goes out as a probe, with the wait
+// doubling after every failed one. Any answer closes the breaker again.
+struct ModbusBreaker {
+	uint8_t slave = 0;
+	ModbusBreakerState state = ModbusBreakerState::Closed;
+	unsigned failures = 0;  // Timeouts in a row
+	Duration backoff = MODBUS_BREAKER_MIN_BACKOFF;
+	Timestamp probeAt = {};
+
+	unsigned long opened = 0;
+	unsigned long halfOpened = 0;
+	unsigned long closed = 0;
+	unsigned long shortCircuited = 0;  // Failed without going out
+
+	// Whether a transaction may go on the wire now
+	auto allow(Timestamp now) -> bool {
+		if (state != ModbusBreakerState::Open) {
+			return true;
+		}
+		if ((now - probeAt) < 0_ms) {
+			++shortCircuited;
+			return false;
+		}
+		state = ModbusBreakerState::HalfOpen;
+		++halfOpened;
+		return true;
+	}
+
+	// Only timeouts count, a garbled answer still means someone is there
+	auto record(ModbusResult result, Timestamp now) -> void {
+		if (result != ModbusResult::Timeout) {
+			failures = 0;
+			if (state != ModbusBreakerState::Closed) {
+				state = ModbusBreakerState::Closed;
+				backoff = MODBUS_BREAKER_MIN_BACKOFF;
+				++closed;
+			}
+			return;
+		}
+
+		++failures;
+		if (state == ModbusBreakerState::HalfOpen) {
+			backoff = std::min(Duration{backoff.unsafeGetValue() * 2},
+							   MODBUS_BREAKER_MAX_BACKOFF);
+		} else if (state == ModbusBreakerState::Open ||
+				   failures < MODBUS_BREAKER_THRESHOLD) {
+			return;
+		}
+		state = ModbusBreakerState::Open;
+		probeAt = now + backoff;
+		++opened;
+	}
+};
+
+// Shares one RTU master between everyone on the RS485 port. Callers enqueue
+// transactions by priority and get their result through a completion
+// callback, the bus feeds them to the master one at a time.
+template <typename = void>
+struct ModbusBusImpl {
+	ModbusBusImpl(RS485Class& rs485, unsigned long baud) : rtu{rs485, baud} {}
+
+	// Disable copy, the bus owns the port
+	ModbusBusImpl(ModbusBusImpl const&) = delete;
+	auto operator=(ModbusBusImpl const&) -> ModbusBusImpl& = delete;
+
+	auto begin() -> void {
+		rtu.begin();
+		resetStats(Timestamp{millis()});
+	}
+
+	auto submit(ModbusTransaction const& tx) -> bool {
+		auto const cls = static_cast<size_t>(tx.priority);
+		auto& q = queues[cls];
+		if (q.size == q.slots.size()) {
+			++stats[cls].dropped;
+			log.warn("queue full, dropping request for slave ",
+				static_cast<int>(tx.slave), " fn ",
+				static_cast<int>(tx.function), " @", tx.address);
+			return false;
+		}
+
+		auto& slot = q.slots[(q.head + q.size) % q.slots.size()];
+		slot = tx;
+		slot.queuedAt = Timestamp{millis()};
+		++q.size;
+		return true;
+	}
+
+	auto tick(Timestamp now) -> void {
+		if (!rtu.isBusy()) {
+			startNext(now);
+		} else if (auto const result = rtu.step()) {
+			finish(*result, now);
+		}
+	}
+
+	auto pending() const -> size_t {
+		auto total = size_t{0};
+		for (auto const& q : queues) {
+			total += q.size;
+		}
+		return total;
+	}
+	auto isIdle() const -> bool { return !rtu.isBusy() && !pending(); }
+
+	auto classStats(ModbusPriority priority) const -> ModbusClassStats const& {
+		return stats[static_cast<size_t>(priority)];
+	}
+
+	auto getBaud() const -> unsigned long { return rtu.getBaud(); }
+	auto getTiming() const -> ModbusTiming const& { return rtu.getTiming(); }
+
+	auto statsElapsed(Timestamp now) const -> Duration {
+		return now - statsSince;
+	}
+
+	// Bytes on the wire in both directions, per second since begin()
+	auto bytesPerSecond(Timestamp now) const -> unsigned long {
+		auto total = 0ul;
+		for (auto const& st : stats) {
+			total += st.txBytes + st.rxBytes;
+		}
+		auto const elapsedMs = (now - statsSince).unsafeGetValue();
+		return elapsedMs > 0 ? total * 1000 / elapsedMs : 0;
+	}
+
+	// Per slave and function code, in the order they were first seen
+	auto tagStats() const -> ModbusTagStats const* { return tags.data(); }
+	auto tagCount() const -> size_t { return tagsUsed; }
+	// Transactions that didn't fit in the tag table
+	auto untagged() const -> unsigned long { return tagsOverflow; }
+
+	auto breakerStats() const -> ModbusBreaker const* {
+		return breakers.data();
+	}
+	auto breakerCount() const -> size_t { return breakersUsed; }
+
+	// False while the slave's breaker is open or probing
+	auto isReachable(uint8_t slave) const -> bool {
+		for (auto i = size_t{0}; i < breakersUsed; ++i) {
+			if (breakers[i].slave == slave) {
+				return breakers[i].state == ModbusBreakerState::Closed;
+			}
+		}
+		return true;
+	}
+
+	// Share of the last seconds the line was busy, in percent
+	auto utilization(Timestamp now) -> double {
+		return busyWindow.percent(now);
+	}
+
+	auto resetStats(Timestamp now) -> void {
+		stats = {};
+		tags = {};
+		tagsUsed = 0;
+		tagsOverflow = 0;
+		busyWindow.reset(now);
+		for (auto& breaker : breakers) {
+			breaker.opened = 0;
+			breaker.halfOpened = 0;
+			breaker.closed = 0;
+			breaker.shortCircuited = 0;
+		}
+		statsSince = now;
+	}
+
+   private:
+	struct Queue {
+		std::array<ModbusTransaction, MODBUS_QUEUE_SIZE> slots;
+		size_t head = 0;
+		size_t size = 0;
+
+		auto front() -> ModbusTransaction& { return slots[head]; }
+		auto pop() -> void {
+			head = (head + 1) % slots.size();
+			--size;
+		}
+	};
+
+	auto current() -> ModbusTransaction& {
+		return queues[currentClass].front();
+	}
+
+	// Highest priority first, but anything past its deadline jumps ahead
+	auto pickClass(Timestamp now) -> optional<size_t> {
+		for (auto cls = 0u; cls < MODBUS_PRIORITIES; ++cls) {
+			auto& q = queues[cls];
+			if (q.size && (now - q.front().queuedAt) > MODBUS_DEADLINES[cls]) {
+				return cls;
+			}
+		}
+		for (auto cls = 0u; cls < MODBUS_PRIORITIES; ++cls) {
+			if (queues[cls].size) {
+				return cls;
+			}
+		}
+		return {};
+	}
+
+	auto startNext(Timestamp now) -> void {
+		if (!rtu.isReady()) {
+			return;
+		}
+
+		// Bounded, a completion may queue its next request right away
+		auto cls = pickClass(now);
+		for (auto left = pending(); cls && !admit(*cls, now);) {
+			cls = --left > 0 ? pickClass(now) : std::nullopt;
+		}
+		if (!cls) {
+			return;
+		}
+		currentClass = *cls;
+
+		auto& st = stats[currentClass];
+		auto const wait = now - current().queuedAt;
+		st.totalWait = st.totalWait + wait;
+		st.maxWait = std::max(st.maxWait, wait);
+		if (wait > MODBUS_DEADLINES[currentClass]) {
+			++st.deadlineMisses;
+		}
+
+		rtu.start(current());
+	}
+
+	// Fails the front of the class right away if its slave is unreachable
+	auto admit(size_t cls, Timestamp now) -> bool {
+		currentClass = cls;
+		auto& tx = current();
+		auto* breaker = findBreaker(tx.slave);
+		if (!breaker) {
+			return true;
+		}
+
+		auto const before = breaker->state;
+		if (breaker->allow(now)) {
+			logBreaker(*breaker, before);
+			return true;
+		}
+
+		tx.result = ModbusResult::Unreachable;
+		if (tx.done.fn) {
+			tx.done.fn(tx.done.ctx, tx, now);
+		}
+		queues[currentClass].pop();
+		return false;
+	}
+
+	auto finish(ModbusResult result, Timestamp now) -> void {
+		auto& tx = current();
+		tx.result = result;
+		if (result != ModbusResult::Ok) {
+			log.warn("slave ", static_cast<int>(tx.slave), " fn ",
+				static_cast<int>(tx.function), " @", tx.address, ": ",
+				modbusResultStr(result));
+		}
+		if (auto* breaker = findBreaker(tx.slave)) {
+			auto const before = breaker->state;
+			breaker->record(result, now);
+			logBreaker(*breaker, before);
+		}
+
+		auto& st = stats[currentClass];
+		auto const latency = now - tx.queuedAt;
+		auto const busyUs = rtu.frameUs();
+		++st.transactions;
+		st.txBytes += rtu.txBytes();
+		st.rxBytes += rtu.rxBytes();
+		st.busyUs += busyUs;
+		busyWindow.add(now, busyUs);
+		record(tx, busyUs);
+		st.totalLatency = st.totalLatency + latency;
+		st.maxLatency = std::max(st.maxLatency, latency);
+
+		// Run the callback while the slot is still ours, then release it
+		if (tx.done.fn) {
+			tx.done.fn(tx.done.ctx, tx, now);
+		}
+		queues[currentClass].pop();
+	}
+
+	auto record(ModbusTransaction const& tx, unsigned long busyUs) -> void {
+		auto* tag = findTag(tx.slave, tx.function);
+		if (!tag) {
+			++tagsOverflow;
+			return;
+		}
+		++tag->transactions;
+		tag->txBytes += rtu.txBytes();
+		tag->rxBytes += rtu.rxBytes();
+		switch (tx.result) {
+		case ModbusResult::Ok: tag->latency.add(busyUs); break;
+		case ModbusResult::Timeout: ++tag->timeouts; break;
+		case ModbusResult::BadCrc: ++tag->crcErrors; break;
+		default: ++tag->otherErrors; break;
+		}
+	}
+
+	auto findTag(uint8_t slave, ModbusFunction function) -> ModbusTagStats* {
+		for (auto i = size_t{0}; i < tagsUsed; ++i) {
+			if (tags[i].slave == slave && tags[i].function == function) {
+				return &tags[i];
+			}
+		}
+		if (tagsUsed == tags.size()) {
+			return nullptr;
+		}
+		auto& tag = tags[tagsUsed++];
+		tag.slave = slave;
+		tag.function = function;
+		return &tag;
+	}
+
+	// Slaves past MODBUS_MAX_SLAVES go without a breaker
+	auto findBreaker(uint8_t slave) -> ModbusBreaker* {
+		for (auto i = size_t{0}; i < breakersUsed; ++i) {
+			if (breakers[i].slave == slave) {
+				return &breakers[i];
+			}
+		}
+		if (breakersUsed == breakers.size()) {
+			return nullptr;
+		}
+		auto& breaker = breakers[breakersUsed++];
+		breaker.slave = slave;
+		return &breaker;
+	}
+
+	auto logBreaker(ModbusBreaker const& breaker, ModbusBreakerState before)
+		-> void {
+		if (breaker.state == before) {
+			return;
+		}
+		if (breaker.state == ModbusBreakerState::Open) {
+			log.warn("slave ", static_cast<int>(breaker.slave), " ",
+				modbusBreakerStateStr(before), " -> open after ",
+				breaker.failures, " timeouts, next probe in ",
+				breaker.backoff.unsafeGetValue(), "ms");
+		} else {
+			log("slave ", static_cast<int>(breaker.slave), " ",
+				modbusBreakerStateStr(before), " -> ",
+				modbusBreakerStateStr(breaker.state));
+		}
+	}
+
+	ModbusRtuMaster rtu;
+
+	std::array<Queue, MODBUS_PRIORITIES> queues;
+	size_t currentClass = 0;
+	std::array<ModbusClassStats, MODBUS_PRIORITIES> stats = {};
+	Timestamp statsSince = {};
+	std::array<ModbusTagStats, MODBUS_MAX_TAGS> tags = {};
+	size_t tagsUsed = 0;
+	unsigned long tagsOverflow = 0;
+	ModbusUtilization busyWindow;
+	std::array<ModbusBreaker, MODBUS_MAX_SLAVES> breakers = {};
+	size_t breakersUsed = 0;
+
+	Log<> log{"modbus"};
+};
+
+using ModbusBus = ModbusBusImpl<>;
+
+// A slave on the shared bus. Mirrors the libmodbus calls it replaces, but
+// every call only enqueues the transaction and returns whether it fit.
+struct ModbusSlave {
+	ModbusBus& bus;
+	uint8_t address;
+	Duration turnaround;
+	ModbusPriority priority = ModbusPriority::Control;
+
+	// Same slave, but traffic goes into another priority class
+	auto with(ModbusPriority other) const -> ModbusSlave {
+		auto copy = *this;
+		copy.priority = other;
+		return copy;
+	}
+
+	auto isReachable() const -> bool { return bus.isReachable(address); }
+
+	auto readBits(uint16_t addr, uint16_t count, ModbusCompletion done)
+		-> bool {
+		return read(ModbusFunction::ReadCoils, addr, count, done);
+	}
+
+	auto readInputBits(uint16_t addr, uint16_t count, ModbusCompletion done)
+		-> bool {
+		return read(ModbusFunction::ReadDiscreteInputs, addr, count, done);
+	}
+
+	auto readRegisters(uint16_t addr, uint16_t count, ModbusCompletion done)
+		-> bool {
+		return read(ModbusFunction::ReadHoldingRegisters, addr, count, done);
+	}
+
+	auto readInputRegisters(uint16_t addr,
+							uint16_t count,
+							ModbusCompletion done) -> bool {
+		return read(ModbusFunction::ReadInputRegisters, addr, count, done);
+	}
+
+	auto writeRegister(uint16_t addr,
+					   uint16_t value,
+					   ModbusCompletion done = {}) -> bool {
+		auto tx = make(ModbusFunction::WriteSingleRegister, addr, 1, done);
+		tx.regs[0] = value;
+		return bus.submit(tx);
+	}
+
+	auto writeRegisters(uint16_t addr,
+						uint16_t count,
+						uint16_t const* values,
+						ModbusCompletion done = {}) -> bool {
+		if (count > MODBUS_MAX_REGISTERS) {
+			return false;
+		}
+		auto tx = make(ModbusFunction::WriteMultipleRegisters, addr, count, done);
+		std::copy(values, values + count, tx.regs.begin());
+		return bus.submit(tx);
+	}
+
+	auto writeBits(uint16_t addr,
+				   uint16_t count,
+				   uint8_t const* values,
+				   ModbusCompletion done = {}) -> bool {
+		if (count > MODBUS_MAX_REGISTERS * 2) {
+			return false;
+		}
+		auto tx = make(ModbusFunction::WriteMultipleCoils, addr, count, done);
+		std::copy(values, values + count, tx.bits.begin());
+		return bus.submit(tx);
+	}
+
+   private:
+	auto make(ModbusFunction fn,
+			  uint16_t addr,
+			  uint16_t count,
+			  ModbusCompletion done) -> ModbusTransaction {
+		auto tx = ModbusTransaction{};
+		tx.slave = address;
+		tx.function = fn;
+		tx.address = addr;
+		tx.count = count;
+		tx.priority = priority;
+		tx.turnaround = turnaround;
+		tx.done = done;
+		return tx;
+	}
+
+	auto read(ModbusFunction fn,
+			  uint16_t addr,
+			  uint16_t count,
+			  ModbusCompletion done) -> bool {
+		if (count > MODBUS_MAX_REGISTERS) {
+			return false;
+		}
+		return bus.submit(make(fn, addr, count, done));
+	}
+};
+
+}  // namespace kev
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <Arduino.h>
+#include <RS485.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+
+#include "kev/Time.h"
+
+namespace kev {
+
+using namespace kev::literals;
+using std::optional;
+
+constexpr auto MODBUS_MAX_REGISTERS = 123;  // Write multiple registers limit
+constexpr auto MODBUS_MAX_FRAME = 256;
+constexpr auto MODBUS_UART_FIFO = 128;  // ESP32 hardware TX FIFO
+constexpr auto MODBUS_BITS_PER_CHAR = 10;  // 8N1: start + 8 data + stop
+// The Arduino core moves received bytes out of the UART in chunks, once this
+// many are in or after the line was idle for MODBUS_UART_RX_IDLE characters.
+// Until then we can't see them, so they count as time on the wire.
+constexpr auto MODBUS_UART_RX_CHUNK = 112;
+constexpr auto MODBUS_UART_RX_IDLE = 2;
+
+enum class ModbusFunction : uint8_t {
+	ReadCoils = 0x01,
+	ReadDiscreteInputs = 0x02,
+	ReadHoldingRegisters = 0x03,
+	ReadInputRegisters = 0x04,
+	WriteSingleRegister = 0x06,
+	WriteMultipleCoils = 0x0F,
+	WriteMultipleRegisters = 0x10,
+};
+
+enum class ModbusResult : uint8_t {
+	Ok,
+	Timeout,
+	BadCrc,
+	BadResponse,
+	Exception,
+	Unreachable,  // Never sent, the slave's circuit breaker is open
+};
+
+inline auto modbusResultStr(ModbusResult result) -> char const* {
+	switch (result) {
+	case ModbusResult::Ok: return "ok";
+	case ModbusResult::Timeout: return "timeout";
+	case ModbusResult::BadCrc: return "bad crc";
+	case ModbusResult::BadResponse: return "bad response";
+	case ModbusResult::Exception: return "exception";
+	case ModbusResult::Unreachable: return "unreachable";
+	}
+	return "unknown";
+}
+
+// One request and, once it's done, its answer
+struct ModbusRequest {
+	uint8_t slave = 0;
+	ModbusFunction function = ModbusFunction::ReadHoldingRegisters;
+	uint16_t address = 0;
+	uint16_t count = 0;  // Registers or bits
+	// How long the slave may think before it answers. The time its answer
+	// takes on the wire comes on top, from the baud rate.
+	Duration turnaround = 100_ms;
+
+	ModbusResult result = ModbusResult::Ok;
+	uint8_t exceptionCode = 0;
+
+	// Payload for writes and result for reads. Bits are stored one per byte,
+	// the same way libmodbus did it, so structs like Lamps map directly.
+	union {
+		std::array<uint16_t, MODBUS_MAX_REGISTERS> regs;
+		std::array<uint8_t, MODBUS_MAX_REGISTERS * 2> bits;
+	};
+
+	ModbusRequest() : regs{} {}
+
+	auto ok() const -> bool { return result == ModbusResult::Ok; }
+};
+
+// Frame timing as the Modbus serial line spec derives it from the baud rate.
+// Above 19200 the spec fixes the gaps instead of letting them shrink.
+struct ModbusTiming {
+	unsigned long charUs;     // One character on the wire
+	unsigned long silenceUs;  // t3.5, the quiet time that separates frames
+	unsigned long gapUs;      // t1.5, the longest pause inside a frame
+
+	// Until n more characters are visible to us, once they started coming
+	constexpr auto deliveryUs(size_t n) const -> unsigned long {
+		auto const chunk = std::min<size_t>(n, MODBUS_UART_RX_CHUNK);
+		return gapUs + (chunk + MODBUS_UART_RX_IDLE) * charUs;
+	}
+};
+
+constexpr auto modbusTiming(unsigned long baud) -> ModbusTiming {
+	auto const charUs = (MODBUS_BITS_PER_CHAR * 1000000ul + baud - 1) / baud;
+	if (baud > 19200) {
+		return {charUs, 1750, 750};
+	}
+	return {charUs, charUs * 7 / 2, charUs * 3 / 2};
+}
+
+// CRC-16/MODBUS a byte at a time, the table lives in flash
+constexpr auto modbusCrcTable() -> std::array<uint16_t, 256> {
+	auto table = std::array<uint16_t, 256>{};
+	for (auto i = 0u; i < table.size(); ++i) {
+		auto crc = static_cast<uint16_t>(i);
+		for (auto bit = 0; bit < 8; ++bit) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+		table[i] = crc;
+	}
+	return table;
+}
+
+inline constexpr auto MODBUS_CRC_TABLE = modbusCrcTable();
+
+constexpr auto modbusCrc(uint8_t const* data, size_t len) -> uint16_t {
+	auto crc = uint16_t{0xFFFF};
+	for (auto i = size_t{0}; i < len; ++i) {
+		crc = (crc >> 8) ^ MODBUS_CRC_TABLE[(crc ^ data[i]) & 0xFF];
+	}
+	return crc;
+}
+
+namespace detail {
+constexpr uint8_t MODBUS_CRC_CHECK[] = {'1', '2', '3', '4', '5',
+										'6', '7', '8', '9'};
+}  // namespace detail
+static_assert(modbusCrc(detail::MODBUS_CRC_CHECK, 9) == 0x4B37);
+
+inline auto modbusPutU16(uint8_t* buf, uint16_t value) -> void {
+	buf[0] = static_cast<uint8_t>(value >> 8);
+	buf[1] = static_cast<uint8_t>(value & 0xFF);
+}
+
+inline auto modbusGetU16(uint8_t const* buf) -> uint16_t {
+	return static_cast<uint16_t>((buf[0] << 8) | buf[1]);
+}
+
+// Whole request frame with CRC, returns its length
+inline auto modbusEncode(ModbusRequest const& req, uint8_t* buf) -> size_t {
+	buf[0] = req.slave;
+	buf[1] = static_cast<uint8_t>(req.function);
+	modbusPutU16(buf + 2, req.address);
+	auto len = size_t{4};
+
+	switch (req.function) {
+	case ModbusFunction::ReadCoils:
+	case ModbusFunction::ReadDiscreteInputs:
+	case ModbusFunction::ReadHoldingRegisters:
+	case ModbusFunction::ReadInputRegisters:
+		modbusPutU16(buf + len, req.count);
+		len += 2;
+		break;
+	case ModbusFunction::WriteSingleRegister:
+		modbusPutU16(buf + len, req.regs[0]);
+		len += 2;
+		break;
+	case ModbusFunction::WriteMultipleCoils: {
+		auto const byteCount = (req.count + 7) / 8;
+		modbusPutU16(buf + len, req.count);
+		buf[len + 2] = static_cast<uint8_t>(byteCount);
+		len += 3;
+		for (auto i = 0; i < byteCount; ++i) {
+			buf[len + i] = 0;
+		}
+		for (auto i = 0; i < req.count; ++i) {
+			if (req.bits[i]) {
+				buf[len + i / 8] |= 1 << (i % 8);
+			}
+		}
+		len += byteCount;
+		break;
+	}
+	case ModbusFunction::WriteMultipleRegisters:
+		modbusPutU16(buf + len, req.count);
+		buf[len + 2] = static_cast<uint8_t>(req.count * 2);
+		len += 3;
+		for (auto i = 0; i < req.count; ++i) {
+			modbusPutU16(buf + len, req.regs[i]);
+			len += 2;
+		}
+		break;
+	}
+
+	auto const crc = modbusCrc(buf, len);
+	buf[len++] = static_cast<uint8_t>(crc & 0xFF);
+	buf[len++] = static_cast<uint8_t>(crc >> 8);
+	return len;
+}
+
+// Length of a normal answer, exceptions are always 5 bytes
+inline auto modbusExpectedLength(ModbusRequest const& req) -> size_t {
+	switch (req.function) {
+	case ModbusFunction::ReadCoils:
+	case ModbusFunction::ReadDiscreteInputs:
+		return 3 + (req.count + 7) / 8 + 2;
+	case ModbusFunction::ReadHoldingRegisters:
+	case ModbusFunction::ReadInputRegisters:
+		return 3 + req.count * 2 + 2;
+	case ModbusFunction::WriteSingleRegister:
+	case ModbusFunction::WriteMultipleCoils:
+	case ModbusFunction::WriteMultipleRegisters:
+		return 8;
+	}
+	return MODBUS_MAX_FRAME;
+}
+
+inline auto modbusCheckFrame(ModbusRequest const& req,
+							 uint8_t const* frame,
+							 size_t len) -> ModbusResult {
+	auto const crc = modbusCrc(frame, len - 2);
+	auto const rxCrc =
+		static_cast<uint16_t>(frame[len - 2] | (frame[len - 1] << 8));
+	if (crc != rxCrc) {
+		return ModbusResult::BadCrc;
+	}
+	if (frame[0] != req.slave) {
+		return ModbusResult::BadResponse;
+	}
+	return ModbusResult::Ok;
+}
+
+// Checks an answer of modbusExpectedLength bytes, or 5 for an exception, and
+// stores what it carries in the request
+inline auto modbusDecode(ModbusRequest& req, uint8_t const* frame, size_t len)
+	-> ModbusResult {
+	auto const check = modbusCheckFrame(req, frame, len);
+	if (check != ModbusResult::Ok) {
+		return check;
+	}
+	if (frame[1] == (static_cast<uint8_t>(req.function) | 0x80)) {
+		req.exceptionCode = frame[2];
+		return ModbusResult::Exception;
+	}
+	if (frame[1] != static_cast<uint8_t>(req.function)) {
+		return ModbusResult::BadResponse;
+	}
+
+	switch (req.function) {
+	case ModbusFunction::ReadCoils:
+	case ModbusFunction::ReadDiscreteInputs:
+		for (auto i = 0; i < req.count; ++i) {
+			req.bits[i] = (frame[3 + i / 8] >> (i % 8)) & 1;
+		}
+		break;
+	case ModbusFunction::ReadHoldingRegisters:
+	case ModbusFunction::ReadInputRegisters:
+		for (auto i = 0; i < req.count; ++i) {
+			req.regs[i] = modbusGetU16(frame + 3 + i * 2);
+		}
+		break;
+	case ModbusFunction::WriteSingleRegister:
+	case ModbusFunction::WriteMultipleCoils:
+	case ModbusFunction::WriteMultipleRegisters:
+		if (modbusGetU16(frame + 2) != req.address) {
+			return ModbusResult::BadResponse;
+		}
+		break;
+	}
+	return ModbusResult::Ok;
+}
+
+// Runs one request at a time on the RS485 port without ever waiting on the
+// wire: the frame is trickled into the UART as the FIFO drains and the
+// answer is collected on each step. Frames live in fixed buffers, nothing is
+// allocated.
+template <typename = void>
+struct ModbusRtuMasterImpl {
+	ModbusRtuMasterImpl(RS485Class& rs485, unsigned long baud)
+		: rs485{rs485}, baud{baud}, timing{modbusTiming(baud)} {}
+
+	// Disable copy, the master owns the port
+	ModbusRtuMasterImpl(ModbusRtuMasterImpl const&) = delete;
+	auto operator=(ModbusRtuMasterImpl const&)
+		-> ModbusRtuMasterImpl& = delete;
+
+	auto begin() -> void {
+		rs485.begin(baud, SERIAL_8N1);
+		rs485.receive();
+	}
+
+	auto isBusy() const -> bool { return phase != Phase::Idle; }
+
+	// Idle and the line has been quiet for t3.5
+	auto isReady() const -> bool {
+		return !isBusy() && micros() - lastFrameEndUs >= timing.silenceUs;
+	}
+
+	// The request must stay put until step() returns its result
+	auto start(ModbusRequest& req) -> void {
+		request = &req;
+		txLen = modbusEncode(req, txBuf.data());
+		txWritten = 0;
+		rxLen = 0;
+		txStartUs = micros();
+
+		rs485.noReceive();
+		rs485.beginTransmission();
+		phase = Phase::Sending;
+		continueSending();
+	}
+
+	// The result once the request is over, also stored in the request
+	auto step() -> optional<ModbusResult> {
+		switch (phase) {
+		case Phase::Idle: break;
+		case Phase::Sending: continueSending(); break;
+		case Phase::Receiving: return continueReceiving();
+		}
+		return {};
+	}
+
+	// About the last request
+	auto txBytes() const -> size_t { return txLen; }
+	auto rxBytes() const -> size_t { return rxLen; }
+	// First byte out until the answer was in
+	auto frameUs() const -> unsigned long { return lastFrameEndUs - txStartUs; }
+
+	auto getBaud() const -> unsigned long { return baud; }
+	auto getTiming() const -> ModbusTiming const& { return timing; }
+
+   private:
+	enum class Phase {
+		Idle,
+		Sending,
+		Receiving,
+	};
+
+	auto continueSending() -> void {
+		// Only hand the UART what fits in its FIFO so write() never blocks
+		auto const elapsedUs = micros() - txStartUs;
+		auto const onWire = elapsedUs / timing.charUs;
+		auto const room = onWire + MODBUS_UART_FIFO - txWritten;
+		auto const chunk = std::min<size_t>(txLen - txWritten, room);
+		if (chunk > 0) {
+			rs485.write(txBuf.data() + txWritten, chunk);
+			txWritten += chunk;
+		}
+
+		if (txWritten < txLen || elapsedUs < txLen * timing.charUs) {
+			return;
+		}
+
+		// Everything is out already, so this flush returns right away
+		rs485.endTransmission();
+		rs485.receive();
+		sentUs = micros();
+		lastByteUs = sentUs;
+		phase = Phase::Receiving;
+	}
+
+	auto continueReceiving() -> optional<ModbusResult> {
+		auto& req = *request;
+
+		auto const nowUs = micros();
+		while (rs485.available() > 0 && rxLen < rxBuf.size()) {
+			rxBuf[rxLen++] = static_cast<uint8_t>(rs485.read());
+			lastByteUs = nowUs;
+		}
+
+		auto const expected = modbusExpectedLength(req);
+		auto const isException = rxLen >= 2 && (rxBuf[1] & 0x80);
+		if (isException && rxLen >= 5) {
+			return finish(modbusDecode(req, rxBuf.data(), 5));
+		}
+		if (!isException && rxLen >= expected) {
+			return finish(modbusDecode(req, rxBuf.data(), expected));
+		}
+
+		// Bytes we polled late only make these more lenient, never stricter
+		auto const remaining = expected - std::min(rxLen, expected);
+		if (rxLen == 0) {
+			auto const thinkUs =
+				static_cast<unsigned long>(req.turnaround.unsafeGetValue()) *
+				1000;
+			if (nowUs - sentUs > thinkUs + timing.deliveryUs(expected)) {
+				return finish(ModbusResult::Timeout);
+			}
+		} else if (nowUs - lastByteUs > timing.deliveryUs(remaining)) {
+			return finish(ModbusResult::Timeout);
+		}
+		return {};
+	}
+
+	auto finish(ModbusResult result) -> ModbusResult {
+		request->result = result;
+
+		// Drop any trailing garbage so it doesn't leak into the next frame
+		while (rs485.available() > 0) {
+			rs485.read();
+		}
+
+		phase = Phase::Idle;
+		request = nullptr;
+		lastFrameEndUs = micros();
+		return result;
+	}
+
+	RS485Class& rs485;
+	unsigned long baud;
+	ModbusTiming timing;
+
+	Phase phase = Phase::Idle;
+	ModbusRequest* request = nullptr;
+	std::array<uint8_t, MODBUS_MAX_FRAME> txBuf = {};
+	size_t txLen = 0;
+	size_t txWritten = 0;
+	unsigned long txStartUs = 0;
+	std::array<uint8_t, MODBUS_MAX_FRAME> rxBuf = {};
+	size_t rxLen = 0;
+	unsigned long sentUs = 0;
+	unsigned long lastByteUs = 0;
+	unsigned long lastFrameEndUs = 0;
+};
+
+using ModbusRtuMaster = ModbusRtuMasterImpl<>;
+
+}  // namespace kev
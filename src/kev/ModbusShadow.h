@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <utility>
+
+#include "kev/ModbusBus.h"
+
+namespace kev {
+
+// Merging two dirty spans costs 2 bytes per register in between, a separate
+// frame costs ~17 bytes of header, CRC and echo plus the slave turnaround.
+constexpr auto MODBUS_SHADOW_REG_GAP = 8u;
+
+// Local copy of the registers the firmware writes on a slave.
+// Writes only mark what actually changed and flush() sends the changed
+// spans, merging the ones that are close enough to share a frame. Addresses
+// that were never written through the shadow are never sent, so spans don't
+// merge over values owned by the slave (like the config the user edits).
+template <size_t RegCount>
+struct ModbusShadow {
+	auto writeRegisters(uint16_t addr, uint16_t count, uint16_t const* values)
+		-> void {
+		for (auto i = 0u; i < count && addr + i < RegCount; ++i) {
+			auto const a = addr + i;
+			if (!ownedRegs[a] || regs[a] != values[i]) {
+				regs[a] = values[i];
+				dirtyRegs[a] = true;
+			}
+			ownedRegs[a] = true;
+		}
+	}
+
+	// Resend everything on the next flush, e.g. after the slave rebooted
+	auto invalidate() -> void {
+		dirtyRegs = ownedRegs;
+	}
+
+	auto isDirty() const -> bool { return dirtyRegs.any(); }
+
+	// A larger gap trades bytes for frames, for slaves slow to turn around
+	auto flush(ModbusSlave mb, size_t regGap = MODBUS_SHADOW_REG_GAP) -> void {
+		auto const done = ModbusCompletion::bind<&ModbusShadow::onWrite>(this);
+
+		flushSpans(dirtyRegs, ownedRegs, regGap, MODBUS_MAX_REGISTERS,
+				   [&](size_t from, size_t to) {
+					   return mb.writeRegisters(from, to - from,
+												regs.data() + from, done);
+				   });
+	}
+
+   private:
+	using Span = std::pair<size_t, size_t>;  // [first, second)
+
+	// Next dirty span at or after `from`, extended over clean owned gaps of
+	// up to maxGap addresses. Returns {N, N} when there is nothing left.
+	template <size_t N>
+	static auto nextSpan(std::bitset<N> const& dirty,
+						 std::bitset<N> const& owned,
+						 size_t from,
+						 size_t maxGap,
+						 size_t maxLen) -> Span {
+		auto start = from;
+		while (start < N && !dirty[start]) {
+			++start;
+		}
+		if (start == N) {
+			return {N, N};
+		}
+
+		auto end = start + 1;
+		for (auto i = end; i < N && (i - start) < maxLen; ++i) {
+			if (dirty[i]) {
+				end = i + 1;
+				continue;
+			}
+			if (!owned[i] || (i + 1 - end) > maxGap) {
+				break;
+			}
+		}
+		return {start, end};
+	}
+
+	template <size_t N, class Send>
+	static auto flushSpans(std::bitset<N>& dirty,
+						   std::bitset<N> const& owned,
+						   size_t maxGap,
+						   size_t maxLen,
+						   Send send) -> bool {
+		for (auto span = nextSpan(dirty, owned, 0, maxGap, maxLen);
+			 span.first < N;
+			 span = nextSpan(dirty, owned, span.second, maxGap, maxLen)) {
+			if (!send(span.first, span.second)) {
+				return false;  // Queue is full, the rest stays dirty
+			}
+			clear(dirty, span.first, span.second);
+		}
+		return true;
+	}
+
+	template <size_t N>
+	static auto clear(std::bitset<N>& bits, size_t from, size_t to) -> void {
+		for (auto i = from; i < to; ++i) {
+			bits[i] = false;
+		}
+	}
+
+	template <size_t N>
+	static auto mark(std::bitset<N>& bits, size_t from, size_t to) -> void {
+		for (auto i = from; i < to && i < N; ++i) {
+			bits[i] = true;
+		}
+	}
+
+	auto onWrite(ModbusTransaction const& tx, Timestamp) -> void {
+		if (tx.ok()) {
+			return;
+		}
+
+		// Try again on the next flush
+		mark(dirtyRegs, tx.address, static_cast<size_t>(tx.address + tx.count));
+	}
+
+	std::array<uint16_t, RegCount> regs = {};
+	std::bitset<RegCount> ownedRegs;
+	std::bitset<RegCount> dirtyRegs;
+};
+
+}  // namespace kev
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace kev {
+
+// Several producers, one consumer, no locks, the same scheme as LogRing.
+// Producers reserve a slot by moving head and publish it with `ready`, the
+// consumer frees it by moving tail. A full queue refuses the value.
+template <class T, size_t N>
+struct MpscQueue {
+	static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+	static constexpr auto capacity = N;
+
+	// Any producer
+	auto push(T const& value) -> bool {
+		auto idx = head.load(std::memory_order_relaxed);
+		do {
+			if (idx - tail.load(std::memory_order_acquire) >= N) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		} while (!head.compare_exchange_weak(idx, idx + 1,
+											 std::memory_order_acq_rel));
+
+		auto& slot = slots[idx % N];
+		slot.value = value;
+		slot.ready.store(true, std::memory_order_release);
+
+		// The consumer may have taken this slot already, then tail is past
+		// it and the difference wraps
+		auto const depth = idx + 1 - tail.load(std::memory_order_acquire);
+		auto max = maxDepth.load(std::memory_order_relaxed);
+		while (depth <= N && depth > max &&
+			   !maxDepth.compare_exchange_weak(max, depth)) {
+		}
+		return true;
+	}
+
+	// The consumer. A slot that is reserved but not written yet ends the
+	// batch, it's picked up next time.
+	auto pop() -> std::optional<T> {
+		auto const t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) {
+			return {};
+		}
+		auto& slot = slots[t % N];
+		if (!slot.ready.load(std::memory_order_acquire)) {
+			return {};
+		}
+		auto value = slot.value;
+		slot.ready.store(false, std::memory_order_relaxed);
+		tail.store(t + 1, std::memory_order_release);
+		return value;
+	}
+
+	// Tail first, head never falls behind it
+	auto depth() const -> unsigned {
+		auto const t = tail.load(std::memory_order_acquire);
+		auto const h = head.load(std::memory_order_acquire);
+		return std::min(h - t, static_cast<unsigned>(N));
+	}
+	auto maxDepthSeen() const -> unsigned { return maxDepth.load(); }
+	auto droppedCount() const -> unsigned long { return dropped.load(); }
+
+   private:
+	struct Slot {
+		std::atomic<bool> ready{false};
+		T value{};
+	};
+
+	std::array<Slot, N> slots{};
+	std::atomic<unsigned> head{0};
+	std::atomic<unsigned> tail{0};
+	std::atomic<unsigned> maxDepth{0};
+	std::atomic<unsigned long> dropped{0};
+};
+
+}  // namespace kev
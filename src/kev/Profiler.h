@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+#include "kev/Histogram.h"
+
+// 0 turns every KEV_PROFILE_SCOPE into nothing
+#ifndef KEV_PROFILE
+#define KEV_PROFILE 1
+#endif
+
+namespace kev {
+
+constexpr auto PROFILER_MAX_SITES = size_t{16};
+
+// One named place in the code and how long it took, in µs. Only ever
+// entered from one task, its histogram has a single writer.
+struct ProfSite {
+	explicit ProfSite(char const* name);
+
+	char const* name;
+	Histogram hist;
+};
+
+// Every site that has been entered at least once
+template <typename = void>
+struct ProfRegistryImpl {
+	auto add(ProfSite* site) -> void {
+		auto const i = count.fetch_add(1, std::memory_order_relaxed);
+		if (i < PROFILER_MAX_SITES) {
+			sites[i].store(site, std::memory_order_release);
+		}
+	}
+
+	// Calls `f(ProfSite&)` for each, then resets them if asked
+	template <class F>
+	auto forEach(F&& f, bool reset = false) -> void {
+		for (auto& slot : sites) {
+			if (auto* site = slot.load(std::memory_order_acquire)) {
+				f(*site);
+				if (reset) {
+					site->hist.reset();
+				}
+			}
+		}
+	}
+
+	auto overflowed() const -> bool {
+		return count.load() > PROFILER_MAX_SITES;
+	}
+
+   private:
+	std::array<std::atomic<ProfSite*>, PROFILER_MAX_SITES> sites{};
+	std::atomic<size_t> count{0};
+};
+
+using ProfRegistry = ProfRegistryImpl<>;
+
+inline ProfRegistry profRegistry;
+
+inline ProfSite::ProfSite(char const* name) : name{name} {
+	profRegistry.add(this);
+}
+
+// Times its own lifetime into the site
+struct ProfScope {
+	explicit ProfScope(ProfSite& site) : site{site}, start{micros()} {}
+	~ProfScope() { site.hist.record(static_cast<long>(micros() - start)); }
+
+	ProfScope(ProfScope const&) = delete;
+	auto operator=(ProfScope const&) -> ProfScope& = delete;
+
+   private:
+	ProfSite& site;
+	unsigned long start;
+};
+
+}  // namespace kev
+
+#define KEV_PROF_CAT2(a, b) a##b
+#define KEV_PROF_CAT(a, b) KEV_PROF_CAT2(a, b)
+
+// Times the rest of the enclosing block as site `name`, a string literal
+#if KEV_PROFILE
+#define KEV_PROFILE_SCOPE(name)                                     \
+	static ::kev::ProfSite KEV_PROF_CAT(kevProfSite, __LINE__){name}; \
+	::kev::ProfScope KEV_PROF_CAT(kevProfScope, __LINE__) {         \
+		KEV_PROF_CAT(kevProfSite, __LINE__)                         \
+	}
+#else
+#define KEV_PROFILE_SCOPE(name) static_cast<void>(0)
+#endif
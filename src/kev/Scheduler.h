@@ -0,0 +1,218 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "kev/Log.h"
+#include "kev/Time.h"
+
+namespace kev {
+
+using namespace kev::literals;
+
+constexpr auto SCHEDULER_MAX_JOBS = 8;
+// Idle share and wakeups are reported over this window
+constexpr auto SCHEDULER_WINDOW = 1_s;
+
+// A job runs once its deadline has come and returns its next one
+struct SchedulerJob {
+	using Fn = Timestamp (*)(void* ctx, Timestamp now);
+
+	Fn fn = nullptr;
+	void* ctx = nullptr;
+
+	// Adapt a member function `auto f(Timestamp) -> Timestamp`
+	template <auto method, class T>
+	static auto bind(T* self) -> SchedulerJob {
+		return {[](void* ctx, Timestamp now) {
+					return (static_cast<T*>(ctx)->*method)(now);
+				},
+				self};
+	}
+};
+
+// Counters other tasks may read while the owner runs
+struct SchedulerJobStats {
+	char const* name = "";
+	std::atomic<unsigned long> runs{0};
+	std::atomic<long> maxLate{0};  // ms between deadline and run
+	std::atomic<unsigned long> maxRunUs{0};
+};
+
+using SchedulerStats = std::array<SchedulerJobStats, SCHEDULER_MAX_JOBS>;
+
+// Runs the jobs of one task in deadline order and sleeps in between, so
+// nothing polls its own timers on every pass. The due times live in a
+// binary min-heap, a pass only looks at the jobs whose time has come.
+//
+// The sleep is a plain vTaskDelay(): the FreeRTOS idle task then halts the
+// core until the next tick interrupt.
+template <typename = void>
+struct SchedulerImpl {
+	SchedulerImpl(char const* name) : name{name} {}
+
+	// Before the task starts. The first run is at `first`, right away by
+	// default. False when all SCHEDULER_MAX_JOBS are taken.
+	auto add(char const* jobName, SchedulerJob job, Timestamp first = {})
+		-> bool {
+		if (count >= jobs.size()) {
+			log.error("no room for job ", jobName, " in ", name);
+			return false;
+		}
+		auto const id = static_cast<uint8_t>(count++);
+		jobs[id] = job;
+		stats[id].name = jobName;
+		push({first ? first : Timestamp{millis()}, id});
+		return true;
+	}
+
+	// Runs every job that is due. A job that asks to run again right away
+	// waits for the next pass so one job can't starve the others.
+	auto runDue(Timestamp now) -> void {
+		busiest = nullptr;
+		busiestUs = 0;
+		while (size > 0 && (heap[0].due - now) <= 0_ms) {
+			auto const entry = pop();
+			auto& st = stats[entry.job];
+			auto const late = (now - entry.due).unsafeGetValue();
+			if (late > st.maxLate.load(std::memory_order_relaxed)) {
+				st.maxLate.store(late, std::memory_order_relaxed);
+			}
+			st.runs.fetch_add(1, std::memory_order_relaxed);
+
+			auto const& job = jobs[entry.job];
+			auto const start = micros();
+			auto next = job.fn(job.ctx, now);
+			auto const runUs = micros() - start;
+			if (runUs > st.maxRunUs.load(std::memory_order_relaxed)) {
+				st.maxRunUs.store(runUs, std::memory_order_relaxed);
+			}
+			if (!busiest || runUs > busiestUs) {
+				busiest = st.name;
+				busiestUs = runUs;
+			}
+			if ((next - now) <= 0_ms) {
+				next = now + 1_ms;
+			}
+			push({next, entry.job});
+		}
+	}
+
+	auto nextDeadline() const -> Timestamp { return heap[0].due; }
+
+	// From within a job: the job that took longest so far in this pass, if
+	// any ran before it
+	auto busiestInPass() const -> char const* { return busiest; }
+
+	// Blocks the task until `until`, at least for one tick so the idle
+	// task gets to run
+	auto sleepUntil(Timestamp now, Timestamp until) -> void {
+		auto const wait = std::max((until - now).unsafeGetValue(), 1l);
+		auto const start = micros();
+		vTaskDelay(pdMS_TO_TICKS(wait));
+		auto const end = micros();
+
+		windowIdleUs += end - start;
+		++windowWakeups;
+		auto const windowUs = end - windowStart;
+		if (windowUs >= static_cast<unsigned long>(
+							SCHEDULER_WINDOW.unsafeGetValue()) * 1000) {
+			idlePermille.store(
+				static_cast<unsigned>(windowIdleUs * 1000 / windowUs),
+				std::memory_order_relaxed);
+			wakeupsPerSecond.store(
+				static_cast<unsigned>(windowWakeups * 1000000ull / windowUs),
+				std::memory_order_relaxed);
+			windowStart = end;
+			windowIdleUs = 0;
+			windowWakeups = 0;
+		}
+		wakeups.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	auto getName() const -> char const* { return name; }
+	auto jobCount() const -> size_t { return count; }
+	auto jobStats() const -> SchedulerStats const& { return stats; }
+	// Over the last SCHEDULER_WINDOW
+	auto idlePercent() const -> float { return idlePermille.load() / 10.0f; }
+	auto wakeupRate() const -> unsigned { return wakeupsPerSecond.load(); }
+	auto totalWakeups() const -> unsigned long { return wakeups.load(); }
+
+	auto resetStats() -> void {
+		for (auto& st : stats) {
+			st.runs.store(0, std::memory_order_relaxed);
+			st.maxLate.store(0, std::memory_order_relaxed);
+			st.maxRunUs.store(0, std::memory_order_relaxed);
+		}
+		wakeups.store(0, std::memory_order_relaxed);
+	}
+
+   private:
+	struct Entry {
+		Timestamp due;
+		uint8_t job;
+	};
+
+	static auto before(Entry const& a, Entry const& b) -> bool {
+		return (a.due - b.due) < 0_ms;
+	}
+
+	auto push(Entry entry) -> void {
+		auto i = size++;
+		while (i > 0 && before(entry, heap[(i - 1) / 2])) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = entry;
+	}
+
+	auto pop() -> Entry {
+		auto const top = heap[0];
+		auto const last = heap[--size];
+		auto i = size_t{0};
+		for (;;) {
+			auto child = 2 * i + 1;
+			if (child >= size) {
+				break;
+			}
+			if (child + 1 < size && before(heap[child + 1], heap[child])) {
+				++child;
+			}
+			if (!before(heap[child], last)) {
+				break;
+			}
+			heap[i] = heap[child];
+			i = child;
+		}
+		heap[i] = last;
+		return top;
+	}
+
+	char const* name;
+	std::array<SchedulerJob, SCHEDULER_MAX_JOBS> jobs{};
+	SchedulerStats stats{};
+	std::array<Entry, SCHEDULER_MAX_JOBS> heap{};
+	size_t count = 0;
+	size_t size = 0;
+	char const* busiest = nullptr;
+	unsigned long busiestUs = 0;
+
+	unsigned long windowStart = 0;
+	unsigned long windowIdleUs = 0;
+	unsigned long windowWakeups = 0;
+	std::atomic<unsigned> idlePermille{0};
+	std::atomic<unsigned> wakeupsPerSecond{0};
+	std::atomic<unsigned long> wakeups{0};
+	Log<> log{"scheduler"};
+};
+
+using Scheduler = SchedulerImpl<>;
+
+}  // namespace kev
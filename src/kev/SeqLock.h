@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace kev {
+
+// Latest value from one writer to any number of readers, neither side ever
+// waits on the other for long. The sequence is odd while a write is in
+// progress and readers copy again when they saw it odd or changed.
+//
+// The value is copied through release/acquire word atomics, so a torn copy
+// is thrown away by the sequence check instead of being a data race, and no
+// fences are needed (ThreadSanitizer doesn't understand those).
+template <class T>
+struct SeqLock {
+	static_assert(std::is_trivially_copyable_v<T>,
+				  "T is copied as raw words");
+
+	static constexpr auto WORDS = (sizeof(T) + 3) / 4;
+
+	// Writer side
+	auto write(T const& value) -> void {
+		auto words = std::array<uint32_t, WORDS>{};
+		std::memcpy(words.data(), &value, sizeof(T));
+
+		auto const s = seq.load(std::memory_order_relaxed);
+		seq.store(s + 1, std::memory_order_relaxed);
+		for (auto i = size_t{0}; i < WORDS; ++i) {
+			data[i].store(words[i], std::memory_order_release);
+		}
+		seq.store(s + 2, std::memory_order_release);
+	}
+
+	// Reader side, retries while a write is in progress
+	auto read() const -> T {
+		auto words = std::array<uint32_t, WORDS>{};
+		for (;;) {
+			auto const s = seq.load(std::memory_order_acquire);
+			if ((s & 1) == 0) {
+				for (auto i = size_t{0}; i < WORDS; ++i) {
+					words[i] = data[i].load(std::memory_order_acquire);
+				}
+				if (seq.load(std::memory_order_relaxed) == s) {
+					break;
+				}
+			}
+			retries.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		auto value = T{};
+		std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+		return value;
+	}
+
+	// Number of completed writes
+	auto version() const -> unsigned {
+		return seq.load(std::memory_order_acquire) / 2;
+	}
+	auto retryCount() const -> unsigned long { return retries.load(); }
+
+   private:
+	std::array<std::atomic<uint32_t>, WORDS> data{};
+	std::atomic<unsigned> seq{0};
+	mutable std::atomic<unsigned long> retries{0};
+};
+
+}  // namespace kev
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace kev {
+
+// One producer, one consumer, no locks. Each side only ever moves its own
+// index, and reads the other one to find out how far it may go. A full queue
+// refuses the value and counts it instead of blocking the producer.
+template <class T, size_t N>
+struct SpscQueue {
+	static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+	static constexpr auto capacity = N;
+
+	// Producer side
+	auto push(T const& value) -> bool {
+		auto const h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) >= N) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		slots[h % N] = value;
+		head.store(h + 1, std::memory_order_release);
+
+		auto const depth = h + 1 - tail.load(std::memory_order_relaxed);
+		if (depth > maxDepth.load(std::memory_order_relaxed)) {
+			maxDepth.store(depth, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// Consumer side
+	auto pop() -> std::optional<T> {
+		auto const t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire)) {
+			return {};
+		}
+		auto value = slots[t % N];
+		tail.store(t + 1, std::memory_order_release);
+		return value;
+	}
+
+	// Either side, a snapshot that may be stale by the time it's used
+	auto depth() const -> unsigned {
+		return head.load(std::memory_order_acquire) -
+			   tail.load(std::memory_order_acquire);
+	}
+	auto maxDepthSeen() const -> unsigned { return maxDepth.load(); }
+	auto droppedCount() const -> unsigned long { return dropped.load(); }
+
+   private:
+	std::array<T, N> slots{};
+	std::atomic<unsigned> head{0};
+	std::atomic<unsigned> tail{0};
+	std::atomic<unsigned> maxDepth{0};
+	std::atomic<unsigned long> dropped{0};
+};
+
+}  // namespace kev
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <tuple>
+
+#include "kev/Time.h"
+
+namespace kev {
+
+using namespace kev::literals;
+
+// Filter stages take a reading and return the value for the next stage, or
+// nothing to drop the reading. All of them use fixed memory.
+
+// Median of the last N readings, a single spike never gets through and a
+// real step shows up after N / 2 readings
+template <size_t N>
+struct MedianStage {
+	static_assert(N % 2 == 1, "Use an odd window");
+
+	auto apply(double value, Timestamp) -> std::optional<double> {
+		window[next] = value;
+		next = (next + 1) % N;
+		filled = std::min(filled + 1, N);
+
+		auto sorted = window;
+		auto const mid = sorted.begin() + filled / 2;
+		std::nth_element(sorted.begin(), mid, sorted.begin() + filled);
+		return *mid;
+	}
+
+	auto reset() -> void {
+		next = 0;
+		filled = 0;
+	}
+
+   private:
+	std::array<double, N> window = {};
+	size_t next = 0;
+	size_t filled = 0;
+};
+
+// Exponential moving average, new = old + alpha * (reading - old)
+template <int AlphaPercent>
+struct EmaStage {
+	static_assert(AlphaPercent > 0 && AlphaPercent <= 100);
+
+	auto apply(double value, Timestamp) -> std::optional<double> {
+		constexpr auto alpha = AlphaPercent / 100.0;
+		average = average ? *average + alpha * (value - *average) : value;
+		return average;
+	}
+
+	auto reset() -> void { average = {}; }
+
+   private:
+	std::optional<double> average = {};
+};
+
+// Drops readings that moved faster than MaxRate °C/s away from the last
+// accepted one. MaxRejects of them in a row means the jump is real and the
+// next one is taken as the new level.
+template <int MaxRate, int MaxRejects = 3>
+struct RateStage {
+	static_assert(MaxRate > 0 && MaxRejects > 0);
+
+	auto apply(double value, Timestamp now) -> std::optional<double> {
+		if (last) {
+			auto const seconds = (now - lastAt).unsafeGetValue() / 1000.0;
+			auto const delta = value > *last ? value - *last : *last - value;
+			if (delta > MaxRate * seconds && rejects < MaxRejects) {
+				++rejects;
+				return {};
+			}
+		}
+
+		rejects = 0;
+		last = value;
+		lastAt = now;
+		return value;
+	}
+
+	auto reset() -> void {
+		last = {};
+		rejects = 0;
+	}
+
+   private:
+	std::optional<double> last = {};
+	Timestamp lastAt = {};
+	int rejects = 0;
+};
+
+// Runs the stages in order, stopping at the first one that drops the reading
+template <class... Stages>
+struct TempFilter {
+	auto apply(double value, Timestamp now) -> std::optional<double> {
+		auto out = std::optional<double>{value};
+		std::apply(
+			[&](auto&... stage) {
+				((out = out ? stage.apply(*out, now) : out), ...);
+			},
+			stages);
+		return out;
+	}
+
+	auto reset() -> void {
+		std::apply([](auto&... stage) { (stage.reset(), ...); }, stages);
+	}
+
+   private:
+	std::tuple<Stages...> stages;
+};
+
+}  // namespace kev
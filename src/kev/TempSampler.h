@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <functional>
+
+#include "kev/Time.h"
+
+namespace kev {
+
+using namespace kev::literals;
+
+constexpr auto TEMP_SAMPLE_PERIOD = 500_ms;
+
+// Reads N sensors round-robin, one per slot, slots spread evenly over the
+// period. So a tick does at most one SPI transaction, the reads don't bunch
+// up in the same loop iteration and every sensor gets a full conversion time
+// between reads.
+template <class Sensor, size_t N>
+struct TempSampler {
+	static_assert(N > 0);
+
+	TempSampler(std::array<std::reference_wrapper<Sensor>, N> sensors,
+				Duration period = TEMP_SAMPLE_PERIOD)
+		: sensors{sensors},
+		  slot{period.unsafeGetValue() / static_cast<long>(N)} {}
+
+	auto tick(Timestamp now) -> void {
+		if (now - nextSlot < 0_ms) {
+			return;
+		}
+
+		sensors[next].get().sample(now);
+		next = (next + 1) % N;
+
+		// Skip the slots we missed instead of catching up in a burst
+		nextSlot = nextSlot + slot;
+		if (now - nextSlot >= 0_ms) {
+			nextSlot = now + slot;
+		}
+	}
+
+	auto nextDeadline() const -> Timestamp { return nextSlot; }
+
+   private:
+	std::array<std::reference_wrapper<Sensor>, N> sensors;
+	Duration slot;
+	size_t next = 0;
+	Timestamp nextSlot = {};
+};
+
+}  // namespace kev
@@ -1,19 +1,42 @@
 #pragma once
 
 #include <SPI.h>
+#include <algorithm>
 #include <cmath>
 #include <optional>
 
 #include "kev/Log.h"
 #include "kev/Pin.h"
+#include "kev/TempFilter.h"
 #include "kev/Timer.h"
 
 namespace kev {
 
 using namespace kev::literals;
 
+// MAX6675 conversion time, deselecting the chip starts a new conversion and
+// selecting it before this elapses aborts the one in progress
+constexpr auto MAX6675_CONVERSION_TIME = 220_ms;
+// Failed reads in a row before the sensor reports no temperature, until then
+// the last filtered value is held
+constexpr auto TEMP_SENSOR_MAX_MISSES = 4;
+
+// The chambers don't move faster than a couple of °C/s, anything quicker is
+// noise on the thermocouple wires. The median cleans what gets through and
+// the EMA takes the quarter degree steps out.
+using Max6675Filter = TempFilter<RateStage<5>, MedianStage<3>, EmaStage<50>>;
+
+struct TempSensorStats {
+	unsigned long samples = 0;
+	unsigned long errors = 0;
+	unsigned long rejected = 0;  // Dropped by the filter
+	Duration maxInterval = 0;  // Longest time between two samples
+	Timestamp lastSample = {};
+};
+
 template <typename = void>
 struct TempSensorFakeImpl {
+	auto sample(Timestamp) -> void {}
 	auto getTemp(Timestamp) -> std::optional<double> { return temp; }
 	auto forceTemp(double temp) -> void { this->temp = temp; }
 	auto unforceTemp() -> void { this->temp = 20.0; }
@@ -36,86 +59,97 @@ using TempSensorFake = TempSensorFakeImpl<>;
 static auto const max6675Settings =
 	SPISettings{1000000, SPI_MSBFIRST, SPI_MODE0};
 
-template <typename = void>
+template <class Filter = Max6675Filter>
 struct TempSensorMax6675 {
 	TempSensorMax6675(SPIClass& spi, int csPin)
 		: spi{spi}, cs{csPin, Invert::Inverted} {
 		spi.begin();
 	}
 
-	auto getTemp(Timestamp now) -> std::optional<double> {
+	// Reads the chip, meant to be driven by a TempSampler so the reads are
+	// spread out and never land in the middle of a conversion
+	auto sample(Timestamp now) -> void {
 		if (forcedTemp) {
-			return forcedTemp;
+			return;
 		}
 
-		if (lastTemp && !pollInterval.isDone(now)) {
-			return lastTemp;
+		if (stats.samples > 0) {
+			stats.maxInterval =
+				std::max(stats.maxInterval, now - stats.lastSample);
 		}
-
-		pollInterval.reset(now);
+		stats.lastSample = now;
+		++stats.samples;
 
 		auto const read = readTemp();
-		if (read && lastTemp) {
-			lastTemp = *lastTemp * 0.00 + *read * 1.00;
-		} else if (read) {
-			lastTemp = *read;
-		} else {
-			lastTemp = {};
+		if (!read) {
+			++stats.errors;
+			if (++misses >= TEMP_SENSOR_MAX_MISSES) {
+				lastTemp = {};
+				filter.reset();
+			}
+			return;
+		}
+		misses = 0;
+
+		auto const filtered = filter.apply(*read, now);
+		if (!filtered) {
+			++stats.rejected;
+			return;
 		}
+		lastTemp = filtered;
+	}
 
+	// Latest sample, never touches the chip
+	auto getTemp(Timestamp) -> std::optional<double> {
+		if (forcedTemp) {
+			return forcedTemp;
+		}
 		return lastTemp;
 	}
 
 	auto forceTemp(double temp) -> void { forcedTemp = temp; }
 	auto unforceTemp() -> void { forcedTemp = {}; }
+	auto isForced() const -> bool { return forcedTemp.has_value(); }
+
+	auto sampleStats() const -> TempSensorStats const& { return stats; }
 
    private:
 	auto readTemp() -> std::optional<double> {
+		// No settle delays needed, tCSS is 100ns and the transaction setup
+		// alone takes longer than that
 		cs.write(true);
-		delayMicroseconds(100);
 		spi.beginTransaction(max6675Settings);
 		auto raw = spi.transfer16(0);
 		spi.endTransaction();
 		cs.write(false);
-		delayMicroseconds(100);
 
 		if (raw & 0x4) {
-			log("error reading cs = ", cs.getPin(), " raw = ", raw);
+			log.warn("error reading cs = ", cs.getPin(), " raw = ", raw);
 			return {};  // No thermocouple connected
 		}
 
 		auto const temp = (raw >> 3) * 0.25;
 
-		// if (lastTemp && std::abs(temp - *lastTemp) > 100.0) {
-		// 	log("temp sensor reading too different, ignoring. pin = ",
-		// 		cs.getPin(), " temp = ", temp);
-		// 	return {};
-		// }
-
 		if (temp == 0.0) {
-			log("temp sensor reading zero, ignoring. pin = ", cs.getPin());
+			log.warn("temp sensor reading zero, ignoring. pin = ",
+					 cs.getPin());
 			return {};
 		}
 
 		// Raw data comes in quarters of °C
-		// Show data in binary
-		log.partial_start();
-		log.partial("raw = ");
-		for (int i = 15; i >= 0; i--) {
-			log.partial((raw >> i) & 1);
-		}
-		log.partial(", value = ", temp);
-		log.partial(", pin = ", cs.getPin());
-		log.partial_end();
+		log.debug("raw = ", LogBits{raw}, ", value = ", temp,
+				  ", pin = ", cs.getPin());
 		return temp;
 	}
 
 	SPIClass& spi;
-	Timer pollInterval{500_ms};
+	TempSensorStats stats = {};
+	Filter filter = {};
+	int misses = 0;
 	std::optional<double> lastTemp = {};
 	std::optional<double> forcedTemp = {};
 	Output cs;
-	Log<true> log{"temp sensor"};
+	Log<> log{"temp sensor"};
 };
 
 using TempSensor = TempSensorMax6675<>;
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+#include "kev/Histogram.h"
+#include "kev/Log.h"
+#include "kev/Time.h"
+
+namespace kev {
+
+// Names an overrun can be blamed on: the parts of the tick plus whatever
+// held up its start
+constexpr auto TICK_BLAME_SLOTS = size_t{8};
+// Consecutive overruns that raise the alarm, and clean ticks that clear it
+constexpr auto TICK_ALARM_AFTER = 3;
+constexpr auto TICK_ALARM_CLEAR = 100;
+
+struct TickBlame {
+	std::atomic<char const*> name{nullptr};
+	std::atomic<unsigned long> count{0};
+};
+
+// Keeps a tick on a fixed rate and watches it. Each tick records how late
+// it started and how long its work took; start plus work beyond the budget
+// is an overrun. The work is split with mark() into named parts, and an
+// overrun goes to whichever part took longest, or to what held up the start
+// when that was longer still.
+//
+// One task ticks, any task reads the counters.
+template <typename = void>
+struct TickMonitorImpl {
+	TickMonitorImpl(Duration period, Duration budget)
+		: period{period}, budget{budget} {}
+
+	// `lateCulprit` is what ran instead while the tick was due
+	auto begin(Timestamp now, char const* lateCulprit) -> void {
+		if (!due) {
+			due = now;
+		}
+		startUs = micros();
+		// Both clocks count the same µs, the difference survives the wrap
+		auto const dueMs = (due - Timestamp{}).unsafeGetValue();
+		lateUs = static_cast<long>(
+			startUs - static_cast<unsigned long>(dueMs) * 1000);
+		lateness.record(lateUs);
+		culprit = lateCulprit ? lateCulprit : "wakeup";
+		markUs = startUs;
+		heaviest = nullptr;
+		heaviestUs = 0;
+	}
+
+	// Everything since the previous mark was `part`
+	auto mark(char const* part) -> void {
+		auto const nowUs = micros();
+		auto const us = static_cast<long>(nowUs - markUs);
+		if (!heaviest || us > heaviestUs) {
+			heaviest = part;
+			heaviestUs = us;
+		}
+		markUs = nowUs;
+	}
+
+	// When the next tick is due. A tick more than a period behind skips
+	// ahead instead of running back to back to catch up.
+	auto end(Timestamp now) -> Timestamp {
+		auto const workUs = static_cast<long>(markUs - startUs);
+		work.record(workUs);
+		ticks.fetch_add(1, std::memory_order_relaxed);
+
+		if (lateUs + workUs > budget.unsafeGetValue() * 1000) {
+			overruns.fetch_add(1, std::memory_order_relaxed);
+			blame(lateUs > heaviestUs ? culprit : heaviest);
+			clean = 0;
+			if (++streak >= TICK_ALARM_AFTER && !alarm.load()) {
+				log.warn("overrunning for ", streak, " ticks");
+				alarm.store(true, std::memory_order_relaxed);
+			}
+		} else {
+			streak = 0;
+			if (alarm.load() && ++clean >= TICK_ALARM_CLEAR) {
+				log("back within budget");
+				alarm.store(false, std::memory_order_relaxed);
+			}
+		}
+
+		due = due + period;
+		while ((due - now) <= 0_ms) {
+			due = due + period;
+			skipped.fetch_add(1, std::memory_order_relaxed);
+		}
+		return due;
+	}
+
+	// Overruns kept up for TICK_ALARM_AFTER ticks
+	auto inAlarm() const -> bool { return alarm.load(); }
+
+	auto getPeriod() const -> Duration { return period; }
+	auto getBudget() const -> Duration { return budget; }
+	auto tickCount() const -> unsigned long { return ticks.load(); }
+	auto overrunCount() const -> unsigned long { return overruns.load(); }
+	auto skippedCount() const -> unsigned long { return skipped.load(); }
+	// µs from when it was due to when it started
+	auto latenessStats() const -> HistogramSummary {
+		return lateness.summary();
+	}
+	auto workStats() const -> HistogramSummary { return work.summary(); }
+	auto blames() const -> std::array<TickBlame, TICK_BLAME_SLOTS> const& {
+		return blamed;
+	}
+
+	// Any task. The histograms clear on the next tick, the alarm stays.
+	auto resetStats() -> void {
+		lateness.reset();
+		work.reset();
+		ticks.store(0, std::memory_order_relaxed);
+		overruns.store(0, std::memory_order_relaxed);
+		skipped.store(0, std::memory_order_relaxed);
+		for (auto& b : blamed) {
+			b.count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+   private:
+	auto blame(char const* name) -> void {
+		for (auto& b : blamed) {
+			auto const n = b.name.load(std::memory_order_relaxed);
+			if (n == name || !n) {
+				b.name.store(name, std::memory_order_relaxed);
+				b.count.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+	}
+
+	Duration period;
+	Duration budget;
+	Timestamp due = {};
+
+	unsigned long startUs = 0;
+	unsigned long markUs = 0;
+	long lateUs = 0;
+	char const* culprit = nullptr;
+	char const* heaviest = nullptr;
+	long heaviestUs = 0;
+	int streak = 0;
+	int clean = 0;
+
+	Histogram lateness;
+	Histogram work;
+	std::atomic<unsigned long> ticks{0};
+	std::atomic<unsigned long> overruns{0};
+	std::atomic<unsigned long> skipped{0};
+	std::atomic<bool> alarm{false};
+	std::array<TickBlame, TICK_BLAME_SLOTS> blamed{};
+	Log<> log{"tick"};
+};
+
+using TickMonitor = TickMonitorImpl<>;
+
+}  // namespace kev
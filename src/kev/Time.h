@@ -93,4 +93,9 @@ constexpr auto operator-(Timestamp const& stamp,
 	return {stamp.value - static_cast<unsigned long>(dur.unsafeGetValue())};
 }
 
+// The sooner of two deadlines, wrap-around safe like the rest
+constexpr auto earliest(Timestamp const& a, Timestamp const& b) -> Timestamp {
+	return (a - b) < Duration{0} ? a : b;
+}
+
 }  // namespace kev
@@ -10,6 +10,9 @@ struct Timer {
 
 	auto isDone(Timestamp now) -> bool { return (now - last) > setting; }
 
+	// First instant isDone() is true
+	auto deadline() const -> Timestamp { return last + setting + Duration{1}; }
+
 	auto elapsedSec(Timestamp now) -> long {
 		return (now - last).unsafeGetValue() / 1000;
 	}
@@ -1,20 +1,29 @@
 #include <Arduino.h>
 #include <SPI.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include <array>
 
 #include "PhysicalUi.h"
 #include "kev/AutonicsTempController.h"
 #include "kev/Log.h"
+#include "kev/ModbusBus.h"
 #include "kev/Pin.h"
+#include "kev/Profiler.h"
+#include "kev/Scheduler.h"
+#include "kev/TempSampler.h"
 #include "kev/TempSensor.h"
+#include "kev/TickMonitor.h"
 #include "kev/Timer.h"
 
 #include "Chamber.h"
+#include "ControlLink.h"
 #include "Main.h"
 #include "Rotation.h"
 #include "State.h"
 #include "Ui.h"
+#include "UiEvents.h"
 #include "UiSerial.h"
 #include "UiWeb.h"
 
@@ -26,8 +35,12 @@ using kev::Input;
 using kev::InputMode;
 using kev::Invert;
 using kev::Log;
+using kev::ModbusBus;
 using kev::Output;
 using kev::RepeatedOutput;
+using kev::Scheduler;
+using kev::SchedulerJob;
+using kev::TickMonitor;
 using kev::Timer;
 using kev::Timestamp;
 using std::array;
@@ -48,34 +61,77 @@ constexpr auto PHY_ROTATION_PIN = 39;
 constexpr auto SCREEN_ADDR = 1;
 constexpr auto TEMP_CONTROLLER_ADDR = 2;
 
-constexpr auto STATS_ENABLED = false;
+// Each sensor must get a full conversion between two reads
+static_assert(kev::TEMP_SAMPLE_PERIOD >= kev::MAX6675_CONVERSION_TIME);
+
+// The screen and the temperature controller share the RS485 port and must
+// both be set to this rate on the devices. The frame timing follows from it.
+constexpr auto BUS_BAUDS = 38400;
+
+// The control task gets the application core to itself, the comms task
+// shares the protocol core with the WiFi stack. Both sleep until their next
+// deadline, which also lets the idle task feed the watchdog.
+constexpr auto CONTROL_CORE = 1;
+constexpr auto COMMS_CORE = 0;
+constexpr auto CONTROL_PRIORITY = 3;
+constexpr auto COMMS_PRIORITY = 2;
+constexpr auto TASK_STACK = 8192;
+
+// MainImpl runs at this fixed rate whatever else the task does. Starting
+// late plus working beyond the budget is an overrun, a few in a row light
+// the overrun lamp.
+constexpr auto CONTROL_PERIOD = 100_ms;
+constexpr auto CONTROL_BUDGET = 20_ms;
+// Typing speed, the RX buffer holds far more than comes in meanwhile
+constexpr auto SERIAL_POLL = 20_ms;
+// While a frame is on the wire or log lines wait for the TX buffer
+constexpr auto BUSY_POLL = 1_ms;
 
 auto spi = SPIClass{VSPI};
 auto chambers = array{
 	Chamber{TempSensor{spi, SENSOR_CS_1}, Output{FAN_PIN1, Invert::Inverted}},
 	Chamber{TempSensor{spi, SENSOR_CS_2}, Output{FAN_PIN2, Invert::Inverted}},
 	Chamber{TempSensor{spi, SENSOR_CS_3}, Output{FAN_PIN3, Invert::Inverted}}};
+auto sampler = kev::TempSampler<TempSensor, 3>{
+	{chambers[0].sensor, chambers[1].sensor, chambers[2].sensor}};
 auto rotation = Rotation{.fw = Output{2, Invert::Inverted},
 						 .bw = Output{4, Invert::Inverted}};
 
 auto stopInput = Input{PHY_STOP_PIN, Invert::Normal};
 auto rotationInput = Input{PHY_ROTATION_PIN, Invert::Inverted};
 
-auto tempController = AutonicsTempController{&RS485, TEMP_CONTROLLER_ADDR};
+auto bus = ModbusBus{RS485, BUS_BAUDS};
+auto tempController = AutonicsTempController{bus, TEMP_CONTROLLER_ADDR};
 
 auto persistent = State{};
 
-auto main_ = Main{chambers, rotation, tempController, persistent};
+auto events = UiEvents{};
+auto main_ = Main{chambers, rotation, tempController, persistent, events};
+auto link = ControlLink{};
 
 Log<> log_{"main"};
 Timer logTimer{1_s};
-UiSerial uiSerial{Serial, main_, chambers};
-Ui ui{main_, persistent, SCREEN_ADDR};
+Scheduler controlSched{"control"};
+Scheduler commsSched{"comms"};
+TickMonitor controlTick{CONTROL_PERIOD, CONTROL_BUDGET};
+
+UiSerial uiSerial{Serial,
+				  link,
+				  events,
+				  bus,
+				  tempController,
+				  {&controlSched, &commsSched},
+				  controlTick};
+Ui ui{link, events, bus, SCREEN_ADDR};
 PhysicalUi physicalUi{
-	main_,
+	events,
 	{.stopButton = stopInput, .rotationButton = rotationInput}};
 
-UiWeb uiWeb{main_, chambers};
+UiWeb uiWeb{link, events};
+
+void controlTask(void*);
+void commsTask(void*);
+auto scheduleJobs() -> bool;
 
 void setup() {
 	Serial.begin(115200);
@@ -86,48 +142,139 @@ void setup() {
 	auto pauseData = persistent.inner.pauseData;
 
 	uiSerial.begin();
+	bus.begin();
 	ui.begin();
 	// uiWeb.begin();
-	tempController.begin();
 	main_.setConfig(config);
 	main_.setPauseData(pauseData, {});
 
+	link.publish(main_.status(Timestamp{millis()}));
+	link.publishDetails(main_.details(Timestamp{millis()}));
+
 	log_(version);
-}
+	kev::logDrain(true);
 
-auto avgUiTick = 0.0, avgMainTick = 0.0, avgTotalTick = 0.0;
-Timer statsTimer{1_s};
+	// A task missing a job would run half a controller, leave the outputs
+	// as they are and do nothing
+	if (!scheduleJobs()) {
+		log_.error("not starting, raise SCHEDULER_MAX_JOBS");
+		kev::logDrain(true);
+		return;
+	}
+	xTaskCreatePinnedToCore(controlTask, "control", TASK_STACK, nullptr,
+							CONTROL_PRIORITY, nullptr, CONTROL_CORE);
+	xTaskCreatePinnedToCore(commsTask, "comms", TASK_STACK, nullptr,
+							COMMS_PRIORITY, nullptr, COMMS_CORE);
+}
 
+// Everything runs in the two tasks
 void loop() {
-	auto now = Timestamp{millis()};
-
-	uiSerial.tick(now);
-	//uiWeb.tick(now);
-
-	auto uiStart = Timestamp{millis()};
-	ui.tick(now);
-	auto uiEnd = Timestamp{millis()};
-
-	physicalUi.tick(now);
-	auto mainStart = Timestamp{millis()};
-	main_.tick(now);
-	auto mainEnd = Timestamp{millis()};
-
-	auto uiDur = uiEnd - uiStart;
-	auto mainDur = mainEnd - mainStart;
-	auto totalDur = mainEnd - now;
-
-	avgUiTick = avgUiTick * 0.9 + uiDur.unsafeGetValue() * 0.1;
-	avgMainTick = avgMainTick * 0.9 + mainDur.unsafeGetValue() * 0.1;
-	avgTotalTick = avgTotalTick * 0.9 + totalDur.unsafeGetValue() * 0.1;
-
-	if (statsTimer.isDone(now) && STATS_ENABLED) {
-		statsTimer.reset(now);
-		printf(
-			"Stats: ui = %.3f, uiCurrState = %.3f, uiInput = %.3f, "
-			"uiSendLamps = %.3f, uiSendStrings = %.3f, uiReqPv = %.3f, "
-			"main = %.3f, total = %.3f\n",
-			avgUiTick, ui.avgCurrState, ui.avgInput, ui.avgSendLamps,
-			ui.avgSendStrings, ui.avgReqPv, avgMainTick, avgTotalTick);
+	vTaskDelete(nullptr);
+}
+
+Timer detailsTimer{MAIN_DETAILS_PERIOD};
+
+// Commands, MainImpl and the outputs, every CONTROL_PERIOD
+auto controlMain(Timestamp now) -> Timestamp {
+	controlTick.begin(now, controlSched.busiestInPass());
+
+	auto applied = false;
+	while (auto const command = link.nextCommand()) {
+		main_.apply(*command, now);
+		applied = true;
+	}
+	controlTick.mark("commands");
+
+	{
+		KEV_PROFILE_SCOPE("main.tick");
+		main_.tick(now);
 	}
+	controlTick.mark("main");
+
+	auto const mainEnd = Timestamp{millis()};
+	auto status = main_.status(mainEnd);
+	status.overrunAlarm = controlTick.inAlarm();
+	link.publish(status);
+	if (applied || detailsTimer.isDone(now)) {
+		detailsTimer.reset(now);
+		link.publishDetails(main_.details(mainEnd));
+	}
+	controlTick.mark("publish");
+
+	return controlTick.end(Timestamp{millis()});
+}
+
+// Sensors and buttons. Never waits on the bus.
+void controlTask(void*) {
+	for (;;) {
+		auto now = Timestamp{millis()};
+		{
+			KEV_PROFILE_SCOPE("control.pass");
+			controlSched.runDue(now);
+		}
+
+		controlSched.sleepUntil(Timestamp{millis()},
+								controlSched.nextDeadline());
+	}
+}
+
+// Panel, temperature controller, serial and the bus they share
+void commsTask(void*) {
+	for (;;) {
+		auto now = Timestamp{millis()};
+		{
+			KEV_PROFILE_SCOPE("comms.pass");
+			commsSched.runDue(now);
+
+			// Bus I/O happens here and only ever advances by what is ready
+			{
+				KEV_PROFILE_SCOPE("bus.tick");
+				bus.tick(Timestamp{millis()});
+			}
+
+			// Whatever was logged goes out as far as the TX buffer takes it
+			kev::logDrain();
+		}
+
+		// Bus and log aren't jobs, they only need attention while busy
+		auto const end = Timestamp{millis()};
+		auto next = commsSched.nextDeadline();
+		if (!bus.isIdle() || kev::logRing.depth() > 0) {
+			next = kev::earliest(next, end + BUSY_POLL);
+		}
+		commsSched.sleepUntil(end, next);
+	}
+}
+
+// Each job returns when it wants to run next, the tasks sleep until the
+// earliest of them. False when a scheduler is out of room.
+auto scheduleJobs() -> bool {
+	auto ok = true;
+	ok &= controlSched.add("sensors", {[](void*, Timestamp now) {
+						       KEV_PROFILE_SCOPE("sensors");
+						       sampler.tick(now);
+						       return sampler.nextDeadline();
+					       }});
+	ok &= controlSched.add("buttons", {[](void*, Timestamp now) {
+						       physicalUi.tick(now);
+						       return now + PHYSICAL_UI_POLL;
+					       }});
+	ok &= controlSched.add("main", {[](void*, Timestamp now) {
+						       return controlMain(now);
+					       }});
+
+	ok &= commsSched.add("serial", {[](void*, Timestamp now) {
+					         uiSerial.tick(now);
+					         return now + SERIAL_POLL;
+				         }});
+	ok &= commsSched.add("ui", {[](void*, Timestamp now) {
+					         KEV_PROFILE_SCOPE("ui.tick");
+					         ui.tick(now);
+					         return ui.nextDeadline();
+				         }});
+	ok &= commsSched.add("autonics", {[](void*, Timestamp now) {
+					         tempController.tick(now);
+					         return tempController.nextDeadline(now);
+				         }});
+	return ok;
 }